@@ -0,0 +1,43 @@
+/*
+ *	MODBUS RTU CRC used by the Mercury 236 protocol.
+ *
+ *	Several implementations are provided, the one used by ModRTU_CRC() is chosen
+ *	at build time with -DCRC_IMPL=<CRC_BITWISE|CRC_TABLE|CRC_SLICE4|CRC_SLICE8>.
+ */
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdint.h>
+
+#define CRC_BITWISE	0		// bit by bit, 8 iterations per byte
+#define CRC_TABLE	1		// 256-entry table, 1 byte per step
+#define CRC_SLICE4	4		// slice-by-4, 4 bytes per step
+#define CRC_SLICE8	8		// slice-by-8, 8 bytes per step
+
+#ifndef CRC_IMPL
+#define CRC_IMPL	CRC_SLICE8
+#endif
+
+// Note, the CRC returned has low and high bytes swapped, so use it accordingly (or swap bytes)
+uint16_t ModRTU_CRC_bitwise(const unsigned char* buf, int len);
+uint16_t ModRTU_CRC_table(const unsigned char* buf, int len);
+uint16_t ModRTU_CRC_slice4(const unsigned char* buf, int len);
+uint16_t ModRTU_CRC_slice8(const unsigned char* buf, int len);
+
+// Compute the MODBUS RTU CRC with the implementation selected at build time
+static inline uint16_t ModRTU_CRC(const unsigned char* buf, int len)
+{
+#if CRC_IMPL == CRC_BITWISE
+	return ModRTU_CRC_bitwise(buf, len);
+#elif CRC_IMPL == CRC_TABLE
+	return ModRTU_CRC_table(buf, len);
+#elif CRC_IMPL == CRC_SLICE4
+	return ModRTU_CRC_slice4(buf, len);
+#elif CRC_IMPL == CRC_SLICE8
+	return ModRTU_CRC_slice8(buf, len);
+#else
+#error "Unknown CRC_IMPL"
+#endif
+}
+
+#endif
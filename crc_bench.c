@@ -0,0 +1,105 @@
+/*
+ *	ModRTU_CRC micro benchmark.
+ *
+ *	Checks that all the CRC implementations give the same results and measures
+ *	their throughput on large blocks and on meter frame sized chunks.
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "crc.h"
+
+#define BUF_SIZE	(16 * 1024 * 1024)	// Test data size (bytes)
+#define BLOCK_SIZE	(64 * 1024)		// Large block size, e.g. memory dump (bytes)
+#define FRAME_SIZE	17			// Typical meter frame without CRC (bytes)
+#define CHECK_LEN	256			// Max length checked for equal results
+#define ROUNDS		8			// Passes over the buffer per measurement
+
+typedef uint16_t (*CrcFunc)(const unsigned char* buf, int len);
+
+typedef struct
+{
+	const char*	name;
+	CrcFunc		func;
+} CrcImpl;
+
+static const CrcImpl impls[] =
+{
+	{ "bitwise", ModRTU_CRC_bitwise },
+	{ "table", ModRTU_CRC_table },
+	{ "slice4", ModRTU_CRC_slice4 },
+	{ "slice8", ModRTU_CRC_slice8 }
+};
+
+#define IMPL_NUM	(int)(sizeof(impls) / sizeof(impls[0]))
+
+volatile uint16_t sink;		// keeps the compiler from dropping the computations
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// -- Compare all the implementations against the bitwise one for every offset and length
+int checkResults(const unsigned char* buf)
+{
+	int failed = 0;
+
+	for (int off = 0; off < 8; off++)
+		for (int len = 0; len <= CHECK_LEN; len++)
+		{
+			uint16_t ref = ModRTU_CRC_bitwise(buf + off, len);
+			for (int i = 1; i < IMPL_NUM; i++)
+				if (impls[i].func(buf + off, len) != ref)
+				{
+					printf("%s mismatch: offset %d, length %d\n", impls[i].name, off, len);
+					failed = 1;
+				}
+		}
+
+	return failed;
+}
+
+// -- Throughput in MB/s when the buffer is processed in chunks of the size given
+double measure(CrcFunc func, const unsigned char* buf, int chunk)
+{
+	double started = now();
+
+	for (int r = 0; r < ROUNDS; r++)
+		for (int pos = 0; pos + chunk <= BUF_SIZE; pos += chunk)
+			sink = func(buf + pos, chunk);
+
+	return (double)ROUNDS * (BUF_SIZE - BUF_SIZE % chunk) / (now() - started) / 1e6;
+}
+
+int main()
+{
+	unsigned char* buf = malloc(BUF_SIZE);
+	if (!buf)
+	{
+		perror("Cannot allocate test data");
+		return 1;
+	}
+
+	srand(236);
+	for (int i = 0; i < BUF_SIZE; i++)
+		buf[i] = rand() & 0xFF;
+
+	if (checkResults(buf))
+		return 1;
+	printf("All %d implementations give the same results\n\n", IMPL_NUM);
+
+	printf("%-10s %14s %14s\n", "CRC", "64K blocks", "frames");
+	for (int i = 0; i < IMPL_NUM; i++)
+		printf("%-10s %9.1f MB/s %9.1f MB/s\n", impls[i].name,
+			measure(impls[i].func, buf, BLOCK_SIZE),
+			measure(impls[i].func, buf, FRAME_SIZE));
+
+	free(buf);
+	return 0;
+}
@@ -10,22 +10,59 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+#include "crc.h"
+#include "mercury236.h"
+
+#ifdef MERCURY_LIBRARY
+#include <setjmp.h>
+#endif
 
 #pragma pack(1)
 #define BAUDRATE 	B9600		// 9600 baud
 #define _POSIX_SOURCE 	1		// POSIX compliant source
 #define UInt16		uint16_t
 #define byte		unsigned char
+#define BAUDRATE_BPS	9600		// BAUDRATE in bits per second
 #define TIME_OUT	50 * 1000	// Mercury inter-command delay (mks)
+#define FRAME_GAP_MIN	20 * 1000	// USB dongles deliver the data in chunks, min gap within a frame (mks)
+#define FRAME_GAP(bps)	((3.5 * 11 * 1000000 / (bps) > FRAME_GAP_MIN) ? \
+			 (long)(3.5 * 11 * 1000000 / (bps)) : FRAME_GAP_MIN)	// 3.5 chars silence ends the frame at bps (mks)
+#define BAUD_AUTO	0		// Baud rate autodetection
+#define BAUD_CACHE	"/var/tmp/mercury236.baud"	// Baud rates detected by the ports
 #define CH_TIME_OUT	2		// Channel timeout (sec)
-#define BSZ		255
-#define PM_ADDRESS	0		// RS485 addess of the power meter
-#define TARRIF_NUM	2		// 2 tariffs supported
+#define PROBE_TIME_OUT	300		// Channel test timeout of the meter cut off by the breaker (ms)
+#define DEF_BREAKER	3		// Default consecutive timeouts cutting the meter off
+#define PROBE_DELAY	10		// Delay of the first probe of the meter cut off, doubled for every next one (sec)
+#define PROBE_DELAY_MAX	3600		// Max delay between the probes (sec)
+#define DEF_RETRIES	2		// Default retries of the failed transaction
+#define RETRY_BACKOFF	10 * 1000	// Delay before the first retry, doubled for every next one (mks)
+#define AUX_WRONG_SIZE	3		// Consecutive array reads of the wrong size giving it up for the per-parameter reads
+#define PM_ADDRESS	0		// Default RS485 addess of the power meter (0 - any meter)
+#define MAX_METERS	32		// Max number of meters polled on one bus
+#define MAX_PORTS	16		// Max number of RS485 dongles polled at the same time
+#define REACTOR_TICK	0xFFFFFFFF	// Reactor event id of the daemon mode interval timer
+#define REACTOR_LISTEN	0xFFFFFFFE	// Reactor event id of the broker socket
+#define REACTOR_CLIENT	0x80000000	// Reactor event id flag of the broker clients
+#define MAX_CLIENTS	64		// Max number of broker clients connected at the same time
+#define ZABBIX_PORT	"10051"		// Default Zabbix trapper port
+#define ZABBIX_TIME_OUT	5		// Zabbix trapper timeout (sec)
+#define MAX_TARIFFS	4		// Max tariffs of the energy counters matrix
 #define OPT_DEBUG	"--debug"
 #define OPT_HELP	"--help"
 #define OPT_TEST_RUN	"--testRun"
@@ -33,8 +70,46 @@
 #define OPT_CSV		"--csv"
 #define OPT_JSON	"--json"
 #define OPT_HEADER	"--header"
+#define OPT_FIXED_DELAY	"--fixedDelay"
+#define OPT_ADDRESS	"--address"
+#define OPT_SCHEDULE	"--schedule"
+#define OPT_DAEMON	"--daemon"
+#define OPT_INTERVAL	"--interval"
+#define OPT_BROKER	"--broker"
+#define OPT_TTL		"--ttl"
+#define OPT_ZABBIX	"--zabbix"
+#define OPT_ZABBIX_HOST	"--zabbixHost"
+#define OPT_FLUSH_SIZE	"--flushSize"
+#define OPT_FLUSH_INT	"--flushInterval"
+#define OPT_STATS	"--stats"
+#define OPT_RETRIES	"--retries"
+#define OPT_TIMEOUT	"--timeout"
+#define OPT_BREAKER	"--breaker"
+#define OPT_BAUD	"--baud"
+#define OPT_PROFILE	"--profile"
+#define OPT_SYNC	"--sync"
+#define OPT_CONSTANT	"--constant"
+#define OPT_COUNTERS	"--counters"
+#define OPT_TARIFFS	"--tariffs"
+#define OPT_FIELDS	"--fields"
+#define DEF_TURNAROUND	20		// Meter turnaround estimate before it is measured (ms)
+#define DEF_INTERVAL	60		// Default polling interval in daemon mode (sec)
+#define DEF_CONSTANT	5000		// Default meter constant (imp/kWh)
+#define PROFILE_MEMORY	0x03		// Memory number of the load profile
+#define PROFILE_SIZE	0x10000		// Load profile memory size, the records are written round
+#define PROFILE_BLOCK	15		// Max profile records read at once (a responce fits BSZ)
+#define PROFILE_CURSORS	"/var/tmp/mercury236.profile"	// Last profile records fetched by the meter serial numbers
+#define COUNTER_CACHE	"/var/tmp/mercury236.counters"	// Energy counters matrix cells by the meter serial numbers
+#define PROFILE_NONE	0xFFFF		// Profile value isn't recorded
 
 int debugPrint = 0;
+int fixedDelay = 0;
+int txRetries = DEF_RETRIES;
+int breakerTimeouts = DEF_BREAKER;
+int baudRate = BAUDRATE_BPS;		// --baud, BAUD_AUTO to detect
+int portBaud = BAUDRATE_BPS;		// baud rate of the port polled by the blocking loop
+volatile sig_atomic_t stopRequested = 0;
+volatile sig_atomic_t statsRequested = 0;
 
 void getDateTimeStr(char *str, int length, time_t time)
 {
@@ -72,6 +147,18 @@ typedef struct
 	UInt16	CRC;
 } ByeCmd;
 
+// Memory read command
+typedef struct
+{
+	byte	address;
+	byte	command;	// 6h
+	byte	memory;		// memory number
+	byte	addrHi;		// first byte address, high byte first
+	byte	addrLo;
+	byte	count;		// bytes to read
+	UInt16	CRC;
+} ReadMemCmd;
+
 // Power meter parameters read command
 typedef struct
 {
@@ -91,87 +178,80 @@ typedef struct
 	UInt16	CRC;
 } Result_1b;
 
-// 3-byte responce
-typedef struct
-{
-	byte	address;
-	byte	res[3];
-	UInt16	CRC;
-} Result_3b;
-
-// Result with 3 bytes per phase
-typedef struct
-{
-	byte	address;
-	byte	p1[3];
-	byte	p2[3];
-	byte	p3[3];
-	UInt16	CRC;
-} Result_3x3b;
-
-// Result with 3 bytes per phase plus 3 bytes for phases sum
+// Last load profile record pointer (parameter 13h)
 typedef struct
 {
-	byte	address;
-	byte	sum[3];
-	byte	p1[3];
-	byte	p2[3];
-	byte	p3[3];
-	UInt16	CRC;
-} Result_4x3b;
-
-// Result with 4 bytes per phase plus 4 bytes for sum
+	byte	addrHi;		// record address, high byte first
+	byte	addrLo;
+	byte	status;
+	byte	time[5];	// record time: hour, minute, day, month, year (BCD)
+	byte	period;		// integration period (min)
+} ProfilePointer;
+
+// Load profile record: average powers over the integration period ending at the record time
 typedef struct
 {
-	byte	address;
-	byte	ap[4];		// active +
-	byte	am[4];		// active -
-	byte	rp[4];		// reactive +
-	byte	rm[4];		// reactive -
-	UInt16	CRC;
-} Result_4x4b;
-
-// 3-phase vector (for voltage, frequency, power by phases)
+	byte	status;
+	byte	time[5];	// hour, minute, day, month, year (BCD)
+	byte	period;		// integration period (min)
+	byte	reserved;
+	UInt16	P[2];		// active + and - energy pulses within the period, PROFILE_NONE if not recorded
+	UInt16	Q[2];		// reactive + and -
+} ProfileRecord;
+
+// Last load profile record fetched from the meter
 typedef struct
 {
-	float	p1;
-	float	p2;
-	float	p3;
-} P3V;
+	char	serial[16];	// meter serial number
+	int	addr;		// record address, -1 if none
+	time_t	time;		// record time
+} ProfileCursor;
 
-// 3-phase vector (for voltage, frequency, power by phases) with sum by all phases
+// RS485 bus driven by the multi-port reactor
 typedef struct
 {
-	float	sum;
-	float	p1;
-	float	p2;
-	float	p3;
-} P3VS;
-
-// Power vector
+	const char*	dev;			// RS485 dongle
+	int		fd;
+	int		timer;			// timerfd for the responce and inter-frame timeouts
+	struct termios	oldtio;
+	int		meterNum;
+	Meter		meters[MAX_METERS];
+	int		busy;			// poll cycle in progress
+	int		meter;			// meter being polled
+	int		step;			// poll step transaction in progress
+	int		baud;			// port baud rate
+	int		reconnected;		// session reopened for the meter within the cycle
+	int		retry;			// retries of the transaction made
+	int		backoff;		// waiting to retry the transaction
+	byte		buf[BSZ];
+	Frame		resp;			// responce being received
+} Bus;
+
+// Broker client connected to the Unix socket
 typedef struct
 {
-	float 	ap;		// active +
-	float	am;		// active -
-	float 	rp;		// reactive +
-	float 	rm;		// reactive -
-} PWV;
-
-// Output results block
+	int		fd;			// -1 if the slot is free
+	char		req[BSZ];		// request lines received
+	int		len;
+	Bus*		bus;			// meter the reply is waited for, NULL if none
+	Meter*		meter;
+	int		poll;			// number of the meter poll to reply with
+} Client;
+
+// Multi-port reactor
 typedef struct
 {
-	P3V 	U;			// voltage
-	P3V	I;			// current
-	P3V	A;			// phase angles
-	P3VS	C;			// cos(f)
-	P3VS	P;			// current active power consumption
-	P3VS	S;			// current reactive power consumption
-	PWV	PR;			// power counters from reset (all tariffs)
-	PWV	PRT[TARRIF_NUM];	// power counters from reset (by tariffs)
-	PWV	PY;			// power counters for yesterday
-	PWV	PT;			// power counters for today
-	float	f;			// grid frequency
-} OutputBlock;
+	int		busNum;
+	Bus		buses[MAX_PORTS];
+	int		format;			// output options
+	int		header;
+	int		showAddress;
+	int		daemonMode;
+	const char*	broker;			// Unix socket path in broker mode, NULL otherwise
+	int		epfd;
+	int		listenFd;
+	Client		clients[MAX_CLIENTS];
+} Reactor;
 
 // **** Enums
 typedef enum
@@ -209,6 +289,21 @@ typedef enum 			// How much energy consumed:
 	PP_YESTERDAY = 5	// yesterday
 } PowerPeriod;
 
+#define PERIOD_NUM	6
+#define COUNTER_CELLS	((PERIOD_NUM - 1 + 12) * (MAX_TARIFFS + 1))	// Energy counters matrix size
+
+const char* periodName[PERIOD_NUM] = { "reset", "year", "lastYear", "month", "today", "yesterday" };
+
+// Energy counters matrix cell
+typedef struct
+{
+	byte	period;		// PowerPeriod
+	byte	month;		// 1..12 for PP_MONTH, 0 otherwise
+	byte	tariff;		// 0 for all tariffs
+	time_t	read;		// when read from the meter, 0 if not read
+	PWV	w;
+} CounterCell;
+
 typedef enum			// Output formatting
 {
 	OF_HUMAN = 0,		// human readable
@@ -216,34 +311,114 @@ typedef enum			// Output formatting
 	OF_JSON = 2		// json
 } OutputFormat;
 
-// Compute the MODBUS RTU CRC
-// Source: http://www.ccontrolsys.com/w/How_to_Compute_the_Modbus_RTU_Message_CRC
-UInt16 ModRTU_CRC(byte* buf, int len)
+// Poll cycle step descriptor
+typedef struct
+{
+	byte		command;
+	byte		paramId;
+	byte		BWRI;
+	int		size;		// value size in the responce (bytes)
+	int		count;		// values number, 0 for status responce
+	float		factor;		// value scale factor
+	size_t		field;		// output block field offset
+	int		groups;		// parameter groups updated (bit mask)
+	const int*	parts;		// steps the responce is made of (STEP_NUM terminated), NULL if the values go to the field
+	const char*	failure;	// failure message
+} StepDesc;
+
+// Auxiliary parameters array layout
+const int auxParts[] = { STEP_P, STEP_S, STEP_U, STEP_I, STEP_COSF, STEP_F, STEP_A, STEP_NUM };
+
+#define STEP_DESC(step, command, paramId, BWRI, size, count, factor, field, groups, parts, failure) \
+	[STEP_##step] = { command, paramId, BWRI, size, count, factor, field, groups, parts, failure },
+const StepDesc stepDesc[STEP_NUM] = { POLL_STEPS(STEP_DESC) };
+
+#define STEP_NAME(step, ...)	#step,
+const char* stepName[STEP_NUM] = { POLL_STEPS(STEP_NAME) };
+
+// Request frame sizes by the steps, the same for all the meters; the frames of all the steps fit the meter plan
+#define REQ_LEN(command) \
+	((0x01 == command) ? sizeof(InitCmd) : (0x00 == command || 0x02 == command) ? sizeof(TestCmd) : sizeof(ReadParamCmd))
+#define STEP_REQ_LEN(step, command, ...)	[STEP_##step] = REQ_LEN(command),
+#define STEP_REQ_SUM(step, command, ...)	+ REQ_LEN(command)
+const byte stepReqLen[STEP_NUM] = { POLL_STEPS(STEP_REQ_LEN) };
+_Static_assert(0 POLL_STEPS(STEP_REQ_SUM) <= PLAN_SIZE, "Poll cycle requests don't fit PLAN_SIZE.");
+
+// Responce timeouts of the commands and the steps (ms), the command one if the step one is 0
+long cmdTimeout = CH_TIME_OUT * 1000L;
+long stepTimeout[STEP_NUM];
+
+// Output values selectable by name, the names of the json output
+typedef struct
 {
-  UInt16 crc = 0xFFFF;
+	const char*	name;
+	size_t		field;
+} OutputField;
 
-  for (int pos = 0; pos < len; pos++) {
-    crc ^= (UInt16)buf[pos];          // XOR byte into least sig. byte of crc
+#define P3V_FIELDS(name, f)	{ name ".p1", OB(f.p1) }, { name ".p2", OB(f.p2) }, { name ".p3", OB(f.p3) }
+#define P3VS_FIELDS(name, f)	{ name ".sum", OB(f.sum) }, P3V_FIELDS(name, f)
+#define PWV_FIELDS(name, f)	{ name ".ap", OB(f.ap) }, { name ".am", OB(f.am) }, { name ".rp", OB(f.rp) }, { name ".rm", OB(f.rm) }
 
-    for (int i = 8; i != 0; i--) {    // Loop over each bit
-      if ((crc & 0x0001) != 0) {      // If the LSB is set
-        crc >>= 1;                    // Shift right and XOR 0xA001
-        crc ^= 0xA001;
-      }
-      else                            // Else LSB is not set
-        crc >>= 1;                    // Just shift right
-    }
-  }
-  // Note, this number has low and high bytes swapped, so use it accordingly (or swap bytes)
-  return crc;
-}
+const OutputField outputFields[] =
+{
+	P3V_FIELDS("U", U), P3V_FIELDS("I", I), P3VS_FIELDS("CosF", C), { "F", OB(f) }, P3V_FIELDS("A", A),
+	P3VS_FIELDS("P", P), P3VS_FIELDS("S", S),
+	PWV_FIELDS("PR", PR), PWV_FIELDS("PR-day", PRT[0]), PWV_FIELDS("PR-night", PRT[1]), PWV_FIELDS("PY", PY), PWV_FIELDS("PT", PT),
+	{ NULL }
+};
+
+#define OUTPUT_FIELDS	(int)(sizeof(outputFields) / sizeof(outputFields[0]) - 1)
+
+// Output values selected (outputFields indexes), all the values are printed if none
+int selectedFields[OUTPUT_FIELDS];
+int selectedNum = 0;
+
+// Data steps of the values selected (validity bits), the poll cycle reads just these
+int wantedFields = FIELDS_ALL;
+
+// Parameter group names for the schedule option and the output
+const char* groupName[GROUP_NUM] = { "U", "I", "C", "F", "A", "P", "S", "W" };
+
+// Polling period of the parameter groups (sec), every cycle if 0
+int groupPeriod[GROUP_NUM];
+int scheduled = 0;
+
+// Broker cache TTL of the parameter groups (sec), not cached if 0
+int groupTTL[GROUP_NUM];
+
+// Broker cache statistics by parameter groups
+typedef struct
+{
+	long	hits;			// served from the cache, fresh or stale
+	long	misses;			// waited for the poll
+	long	refreshes;		// background refreshes queued for the stale data
+} CacheStats;
+
+CacheStats cacheStats[GROUP_NUM];
+
+// Transaction outcome names and the histogram bucket upper bounds (ms), the last bucket is unbounded
+const char* txOutcomeName[TX_OUTCOME_NUM] = { "ok", "timeout", "wrongCRC", "wrongSize", "meterError" };
+const int histBound[HIST_BUCKETS - 1] = { 5, 10, 20, 50, 100, 200, 500, 1000, 2000 };
 
+// Meters of the transaction statistics printed with --stats: the reactor ones or the single port ones
+Reactor* statsReactor = NULL;
+Meter* statsMeters = NULL;
+int statsMeterNum = 0;
 
-// -- Abnormal termination
+#ifdef MERCURY_LIBRARY
+// Failure recovery point of the poll loop when built into a library (e.g. the Zabbix module)
+jmp_buf failureJump;
+#endif
+
+// -- Abnormal termination, the library poll loop recovers instead
 void exitFailure(const char* msg)
 {
 	perror(msg);
+#ifdef MERCURY_LIBRARY
+	longjmp(failureJump, 1);
+#else
 	exit(EXIT_FAIL);
+#endif
 }
 
 // -- Print out data buffer in hex
@@ -258,9 +433,99 @@ void printPackage(byte *data, int size, int isin)
 	}
 }
 
-// -- Non-blocking file read with timeout
+// -- Monotonic clock (ms)
+double nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// -- Account the transaction of the responce frame with its result in the statistics
+// -- The timed out transaction is just counted: its time is the timeout, not the meter's.
+void txRecord(TxStats* s, Frame* f, int result)
+{
+	double now = nowMs(), first = f->first ? f->first : now;
+	double total = now - f->started;
+
+	switch(result)
+	{
+		case OK:			s->count[TX_OK]++; break;
+		case CHECK_CHANNEL_TIME_OUT:	s->count[TX_TIMEOUT]++; return;
+		case WRONG_CRC:			s->count[TX_WRONG_CRC]++; break;
+		case WRONG_RESULT_SIZE:		s->count[TX_WRONG_SIZE]++; break;
+		default:			s->count[TX_METER_ERR]++;
+	}
+
+	s->tx += f->sent - f->started;
+	s->turnaround += first - f->sent;
+	s->rx += now - first;
+	if (total > s->max)
+		s->max = total;
+
+	int b = 0;
+	while (b < HIST_BUCKETS - 1 && total > histBound[b])
+		b++;
+	s->hist[b]++;
+}
+
+// -- Number of the transactions answered: the ones timed
+long txTimed(const TxStats* s)
+{
+	long n = 0;
+
+	for (int i = 0; i < TX_OUTCOME_NUM; i++)
+		if (TX_TIMEOUT != i)
+			n += s->count[i];
+
+	return n;
+}
+
+// -- Print the transaction statistics of the meter as JSON object
+// -- port is the RS485 dongle printed along with the data, none if NULL
+void printStats(FILE* out, Meter* meter, const char* port)
+{
+	TxStats* s = &meter->stats;
+	long timed = txTimed(s), n = timed + s->count[TX_TIMEOUT];
+
+	fprintf(out, "{");
+	if (port)
+		fprintf(out, "\"port\":\"%s\",", port);
+	fprintf(out, "\"address\":%d,\"transactions\":%ld", meter->address, n);
+	for (int i = 0; i < TX_OUTCOME_NUM; i++)
+		fprintf(out, ",\"%s\":%ld", txOutcomeName[i], s->count[i]);
+	fprintf(out, ",\"consecutiveTimeouts\":%d,\"probeDelay\":%d", meter->timeouts, meter->probeDelay);
+	fprintf(out, ",\"avgTxMs\":%.3f,\"avgTurnaroundMs\":%.3f,\"avgRxMs\":%.3f,\"maxMs\":%.3f,\"histogramMs\":{",
+		timed ? s->tx / timed : 0, timed ? s->turnaround / timed : 0, timed ? s->rx / timed : 0, s->max);
+	for (int b = 0; b < HIST_BUCKETS; b++)
+		if (b < HIST_BUCKETS - 1)
+			fprintf(out, "%s\"%d\":%ld", b ? "," : "", histBound[b], s->hist[b]);
+		else
+			fprintf(out, ",\"inf\":%ld", s->hist[b]);
+	fprintf(out, "}}");
+}
+
+// -- Print the transaction statistics of all the meters polled to stderr, one line per meter
+void dumpStats()
+{
+	if (statsReactor)
+		for (int i = 0; i < statsReactor->busNum; i++)
+			for (int m = 0; m < statsReactor->buses[i].meterNum; m++)
+			{
+				printStats(stderr, &statsReactor->buses[i].meters[m], statsReactor->buses[i].dev);
+				fprintf(stderr, "\n");
+			}
+
+	for (int m = 0; m < statsMeterNum; m++)
+	{
+		printStats(stderr, &statsMeters[m], NULL);
+		fprintf(stderr, "\n");
+	}
+}
+
+// -- Wait for the input up to the timeout given (mks)
 // -- Returns 0 if timed out.
-int nb_read_impl(int fd, byte* buf, int sz)
+int nb_wait(int fd, long timeoutMks)
 {
 	fd_set set;
 	struct timeval timeout;
@@ -270,160 +535,340 @@ int nb_read_impl(int fd, byte* buf, int sz)
 	FD_SET(fd, &set);
 
 	// Set timeout
-	timeout.tv_sec = CH_TIME_OUT;
-	timeout.tv_usec = 0;
+	timeout.tv_sec = timeoutMks / 1000000;
+	timeout.tv_usec = timeoutMks % 1000000;
 
-	int r = select(fd + 1, &set, NULL, NULL, &timeout);
+	// Daemon mode stop signal lets the transaction complete
+	int r;
+	while ((r = select(fd + 1, &set, NULL, NULL, &timeout)) < 0 && errno == EINTR)
+		FD_SET(fd, &set);
 	if (r < 0)
 		exitFailure("Select failed.");
-	if (r == 0)
+
+	return r;
+}
+
+// -- Check the frame CRC
+int frameCRC_OK(byte* buf, int len)
+{
+	return len > sizeof(UInt16) &&
+		ModRTU_CRC(buf, len - sizeof(UInt16)) == *(UInt16*)(buf + len - sizeof(UInt16));
+}
+
+// -- Start assembling the frame of sz bytes expected into buf (BSZ bytes)
+void frameStart(Frame* f, byte* buf, int sz)
+{
+	f->buf = buf;
+	f->off = 0;
+	f->len = 0;
+	f->sz = sz;
+	f->started = f->sent = f->first = 0;
+}
+
+// -- Number of bytes to read to complete the frame
+int frameMissing(Frame* f)
+{
+	return f->off + f->sz - f->len;
+}
+
+// -- Account r bytes read into the frame buffer
+// -- Leading junk bytes are dropped until the CRC matches. Returns 1 when the frame is complete.
+int frameReceived(Frame* f, int r)
+{
+	f->len += r;
+	if (f->len - f->off < f->sz)
 		return 0;
 
-	return read(fd, buf, BSZ);
+	if (frameCRC_OK(f->buf + f->off, f->sz))
+		return 1;
+
+	// Not a frame yet, skip one more leading byte
+	if (f->off + f->sz == BSZ)
+		return 1;
+	f->off++;
+
+	return 0;
 }
 
-// -- Non-blocking file read with timeout
-// -- Aborts if timed out.
-int nb_read(int fd, byte* buf, int sz)
+// -- Finish the frame once complete or the line is silent for FRAME_GAP
+// -- The frame found is moved to the beginning of the buffer. Returns its length.
+int frameEnd(Frame* f)
 {
-	int r = nb_read_impl(fd, buf, sz);
-	if (r == 0)
-		exitFailure("Communication channel timeout.");
-	return r;
+	int off = f->off, len = f->len;
+
+	if (len - off < f->sz)
+	{
+		// The meter has answered with a status instead of the data
+		if (len >= sizeof(Result_1b) && frameCRC_OK(f->buf + len - sizeof(Result_1b), sizeof(Result_1b)))
+			off = len - sizeof(Result_1b);
+		// Nothing but a partial frame, return all the bytes received
+		else if (len < f->sz)
+			off = 0;
+		else
+			off = len - f->sz;
+	}
+	len -= off;
+
+	f->dropped = off;
+	if (off > 0)
+		memmove(f->buf, f->buf + off, len);
+
+	return len;
 }
 
-// -- Check 1 byte responce
-int checkResult_1b(byte* buf, int len)
+// -- Non-blocking frame read with the responce timeout given (mks)
+// -- Assembles the expected responce of the frame started from as many reads as it takes.
+// -- Stops as soon as the frame is complete or the line is silent for FRAME_GAP.
+// -- Returns 0 if timed out.
+int nb_read_impl(int fd, Frame* f, long timeoutMks)
 {
-	if (len != sizeof(Result_1b))
-		return WRONG_RESULT_SIZE;
+	// Wait for the meter to start the responce
+	if (!nb_wait(fd, timeoutMks))
+		return 0;
+	f->first = nowMs();
 
-	Result_1b *res = (Result_1b*)buf;
-	UInt16 crc = ModRTU_CRC(buf, len - sizeof(UInt16));
-	if (crc != res->CRC)
-		return WRONG_CRC;
+	do
+	{
+		int r = read(fd, f->buf + f->len, frameMissing(f));
+		if (r <= 0 || frameReceived(f, r))
+			break;
+	}
+	while (nb_wait(fd, FRAME_GAP(portBaud)));
 
-	return res->result & 0x0F;
+	int len = frameEnd(f);
+	if (f->dropped && debugPrint)
+		printf("Dropped bytes: %d\n\r", f->dropped);
+
+	return len;
 }
 
-// -- Check 3 byte responce
-int checkResult_3b(byte* buf, int len)
+// -- Open RS485 dongle and set it up, old port settings are saved to oldtio
+int openPort(const char* dev, struct termios* oldtio)
 {
-	if (len != sizeof(Result_3b))
-		return WRONG_RESULT_SIZE;
+	struct termios newtio;
 
-	Result_3b *res = (Result_3b*)buf;
-	UInt16 crc = ModRTU_CRC(buf, len - sizeof(UInt16));
-	if (crc != res->CRC)
-		return WRONG_CRC;
+	int fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY);
+	if (fd < 0)
+		exitFailure(dev);
 
-	return OK;
+	fcntl(fd, F_SETFL, 0);
+
+	tcgetattr(fd, oldtio); /* save current port settings */
+
+	bzero(&newtio, sizeof(newtio));
+
+	cfsetispeed(&newtio, BAUDRATE);
+	cfsetospeed(&newtio, BAUDRATE);
+
+	newtio.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
+//	newtio.c_cflag = BAUDRATE | CRTSCTS | CS8 | CLOCAL | CREAD;
+//	newtio.c_cflag = BAUDRATE | CS8 | CREAD;
+	newtio.c_iflag = IGNPAR;
+	newtio.c_oflag = 0;
+
+	cfmakeraw(&newtio);
+	tcsetattr(fd, TCSANOW, &newtio);
+
+	return fd;
 }
 
-// -- Check 3 bytes x 3 phase responce
-int checkResult_3x3b(byte* buf, int len)
+// Baud rates supported: the default one first, then the faster ones, then the slower ones (autodetection order)
+typedef struct
 {
-	if (len != sizeof(Result_3x3b))
-		return WRONG_RESULT_SIZE;
+	int	bps;
+	speed_t	speed;
+} BaudRate;
 
-	Result_3x3b *res = (Result_3x3b*)buf;
-	UInt16 crc = ModRTU_CRC(buf, len - sizeof(UInt16));
-	if (crc != res->CRC)
-		return WRONG_CRC;
+const BaudRate baudRates[] =
+{
+	{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+	{ 4800, B4800 }, { 2400, B2400 }, { 1200, B1200 }, { 600, B600 }, { 300, B300 },
+	{ 0 }
+};
 
-	return OK;
+// -- Find the baud rate supported, NULL if none
+const BaudRate* findBaud(int bps)
+{
+	const BaudRate* b = baudRates;
+	while (b->bps && b->bps != bps)
+		b++;
+	return b->bps ? b : NULL;
 }
 
-// -- Check 3 bytes x 3 phase and sum responce
-int checkResult_4x3b(byte* buf, int len)
+// -- Switch the port to the baud rate supported, the input and output queued are dropped
+void setBaud(int fd, int bps)
 {
-	if (len != sizeof(Result_4x3b))
-		return WRONG_RESULT_SIZE;
+	struct termios tio;
+	const BaudRate* b = findBaud(bps);
+
+	tcgetattr(fd, &tio);
+	cfsetispeed(&tio, b->speed);
+	cfsetospeed(&tio, b->speed);
+	tcsetattr(fd, TCSANOW, &tio);
+	tcflush(fd, TCIOFLUSH);
+}
 
-	Result_4x3b *res = (Result_4x3b*)buf;
-	UInt16 crc = ModRTU_CRC(buf, len - sizeof(UInt16));
-	if (crc != res->CRC)
-		return WRONG_CRC;
+// -- Baud rate detected for the port before, 0 if none
+int cachedBaud(const char* dev)
+{
+	char line[BSZ], port[BSZ];
+	int bps = 0, cached;
 
-	return OK;
+	FILE* f = fopen(BAUD_CACHE, "r");
+	if (!f)
+		return 0;
+
+	while (!bps && fgets(line, sizeof(line), f))
+		if (2 == sscanf(line, "%254s %d", port, &cached) && !strcmp(port, dev) && findBaud(cached))
+			bps = cached;
+	fclose(f);
+
+	return bps;
+}
+
+// -- Keep the baud rate detected for the port, the other ports entries are kept as well
+void saveBaud(const char* dev, int bps)
+{
+	char line[BSZ], port[BSZ], tmp[BSZ];
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", BAUD_CACHE, getpid());
+	FILE* out = fopen(tmp, "w");
+	if (!out)
+		return;
+
+	FILE* f = fopen(BAUD_CACHE, "r");
+	if (f)
+	{
+		while (fgets(line, sizeof(line), f))
+			if (1 == sscanf(line, "%254s", port) && strcmp(port, dev))
+				fputs(line, out);
+		fclose(f);
+	}
+	fprintf(out, "%s %d\n", dev, bps);
+	fclose(out);
+
+	rename(tmp, BAUD_CACHE);
+}
+
+// -- Restore the port settings and close it
+void closePort(int fd, struct termios* oldtio)
+{
+	tcsetattr(fd, TCSANOW, oldtio);
+	close(fd);
+}
+
+// -- Send the command to the power meter, the responce frame gets the request timing
+void sendCmd(int ttyd, byte* cmd, int len, Frame* f)
+{
+	printPackage(cmd, len, OUT);
+
+	f->started = nowMs();
+	write(ttyd, cmd, len);
+	tcdrain(ttyd);
+	f->sent = nowMs();
+
+	if (fixedDelay)
+		usleep(TIME_OUT);
 }
 
-// -- Check 4 bytes x 3 phase and sum responce
-int checkResult_4x4b(byte* buf, int len)
+// -- Check 1 byte responce
+int checkResult_1b(byte* buf, int len)
 {
-	if (len != sizeof(Result_4x4b))
+	if (len != sizeof(Result_1b))
 		return WRONG_RESULT_SIZE;
 
-	Result_4x4b *res = (Result_4x4b*)buf;
+	Result_1b *res = (Result_1b*)buf;
 	UInt16 crc = ModRTU_CRC(buf, len - sizeof(UInt16));
 	if (crc != res->CRC)
 		return WRONG_CRC;
 
-	return OK;
+	return res->result & 0x0F;
 }
 
-// -- Check the communication channel
-int checkChannel(int ttyd)
+// -- Check unexpected size responce
+// -- The meter answers with a 1 byte status instead of the data on errors (e.g. when channel isn't open)
+int checkResult_err(byte* buf, int len)
 {
-	// Command initialisation
-	TestCmd testCmd = { .address = PM_ADDRESS, .command = 0x00 };
-	testCmd.CRC = ModRTU_CRC((byte*)&testCmd, sizeof(testCmd) - sizeof(UInt16));
-	printPackage((byte*)&testCmd, sizeof(testCmd), OUT);
+	int r = checkResult_1b(buf, len);
+	return (OK == r) ? WRONG_RESULT_SIZE : r;
+}
 
-	// Send test channel command
-	write(ttyd, (byte*)&testCmd, sizeof(testCmd));
-	usleep(TIME_OUT);
+// -- Check the data responce of the size expected
+int checkResult_data(byte* buf, int len, int size)
+{
+	if (len != size)
+		return checkResult_err(buf, len);
 
-	// Get responce
-	byte buf[BSZ];
-	int len = nb_read_impl(ttyd, buf, BSZ);
-	if (len == 0)
-		return CHECK_CHANNEL_TIME_OUT;
+	UInt16 crc = ModRTU_CRC(buf, len - sizeof(UInt16));
+	if (memcmp(&crc, buf + len - sizeof(UInt16), sizeof(UInt16)))
+		return WRONG_CRC;
 
-	printPackage((byte*)buf, len, IN);
+	return OK;
+}
 
-	return checkResult_1b(buf, len);
+// -- Check the responce of the size expected: 1 byte status or data
+int checkResponce(byte* buf, int len, int size)
+{
+	return (sizeof(Result_1b) == size) ? checkResult_1b(buf, len) : checkResult_data(buf, len, size);
 }
 
-// -- Connection initialisation
-int initConnection(int ttyd)
+// -- Test connection / connection termination command (same layout)
+int shortCmd(byte* frame, byte addr, byte command)
+{
+	TestCmd* cmd = (TestCmd*)frame;
+	cmd->address = addr;
+	cmd->command = command;
+	cmd->CRC = ModRTU_CRC(frame, sizeof(TestCmd) - sizeof(UInt16));
+	return sizeof(TestCmd);
+}
+
+// -- Connection initialisation command
+int initCmd(byte* frame, byte addr)
 {
 	InitCmd initCmd = {
-		.address = PM_ADDRESS,
+		.address = addr,
 		.command = 0x01,
 		.accessLevel = 0x01,
 		.password = { 0x01, 0x01, 0x01, 0x01, 0x01, 0x01 },
 	};
 	initCmd.CRC = ModRTU_CRC((byte*)&initCmd, sizeof(initCmd) - sizeof(UInt16));
-	printPackage((byte*)&initCmd, sizeof(initCmd), OUT);
-
-	write(ttyd, (byte*)&initCmd, sizeof(initCmd));
-	usleep(TIME_OUT);
-
-	// Read initialisation result
-	byte buf[BSZ];
-	int len = nb_read(ttyd, buf, BSZ);
-	printPackage((byte*)buf, len, IN);
-
-	return checkResult_1b(buf, len);
+	memcpy(frame, &initCmd, sizeof(initCmd));
+	return sizeof(initCmd);
 }
 
-// -- Close connection
-int closeConnection(int ttyd)
+// -- Power meter parameters read command
+int readParamCmd(byte* frame, byte addr, byte command, byte paramId, byte BWRI)
 {
-	ByeCmd byeCmd = { .address = PM_ADDRESS, .command = 0x02 };
-	byeCmd.CRC = ModRTU_CRC((byte*)&byeCmd, sizeof(byeCmd) - sizeof(UInt16));
-	printPackage((byte*)&byeCmd, sizeof(byeCmd), OUT);
-
-	write(ttyd, (byte*)&byeCmd, sizeof(byeCmd));
-	usleep(TIME_OUT);
+	ReadParamCmd* cmd = (ReadParamCmd*)frame;
+	cmd->address = addr;
+	cmd->command = command;
+	cmd->paramId = paramId;
+	cmd->BWRI = BWRI;
+	cmd->CRC = ModRTU_CRC(frame, sizeof(ReadParamCmd) - sizeof(UInt16));
+	return sizeof(ReadParamCmd);
+}
 
-	// Read closing responce
-	byte buf[BSZ];
-	int len = nb_read(ttyd, buf, BSZ);
-	printPackage((byte*)buf, len, IN);
+// -- Memory read command: count bytes from the memory address given
+int readMemCmd(byte* frame, byte addr, byte memory, int memAddr, int count)
+{
+	ReadMemCmd* cmd = (ReadMemCmd*)frame;
+	cmd->address = addr;
+	cmd->command = 0x06;
+	cmd->memory = memory;
+	cmd->addrHi = memAddr >> 8;
+	cmd->addrLo = memAddr & 0xFF;
+	cmd->count = count;
+	cmd->CRC = ModRTU_CRC(frame, sizeof(ReadMemCmd) - sizeof(UInt16));
+	return sizeof(ReadMemCmd);
+}
 
-	return checkResult_1b(buf, len);
+/* Power counters by phases for the period command
+	periodId - one of PowerPeriod enum values
+	month - month number when periodId is PP_MONTH
+	tariffNo - 0 for all tariffs, 1 - tariff #1, 2 - tariff #2 etc. */
+int counterCmd(byte* frame, byte addr, int periodId, int month, int tariffNo)
+{
+	return readParamCmd(frame, addr, 0x05, (periodId << 4) | (month & 0xF), tariffNo);
 }
 
 // Decode float from 3 bytes
@@ -440,372 +885,2772 @@ float B4F(byte b[4], float factor)
 	return val/factor;
 }
 
-// Get voltage (U) by phases
-int getU(int ttyd, P3V* U)
+// -- Responce size expected for the poll cycle step
+int stepRespLen(const StepDesc* d)
 {
-	ReadParamCmd getUCmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x11
-	};
-	getUCmd.CRC = ModRTU_CRC((byte*)&getUCmd, sizeof(getUCmd) - sizeof(UInt16));
-	printPackage((byte*)&getUCmd, sizeof(getUCmd), OUT);
-
-	write(ttyd, (byte*)&getUCmd, sizeof(getUCmd));
-	usleep(TIME_OUT);
-
-	// Read responce
-	byte buf[BSZ];
-	int len = nb_read(ttyd, buf, BSZ);
-	printPackage((byte*)buf, len, IN);
+	return d->count ? 1 + d->size * d->count + sizeof(UInt16) : sizeof(Result_1b);
+}
 
-	// Check and decode result
-	int checkResult = checkResult_3x3b(buf, len);
-	if (OK == checkResult)
-	{
-		Result_3x3b* res = (Result_3x3b*)buf;
-		U->p1 = B3F(res->p1, 100.0);
-		U->p2 = B3F(res->p2, 100.0);
-		U->p3 = B3F(res->p3, 100.0);
-	}
+// -- Decode the step values into the output block field
+// -- Returns the next values of the responce
+byte* decodeValues(const StepDesc* d, byte* data, OutputBlock* o)
+{
+	float* v = (float*)((byte*)o + d->field);
+	for (int i = 0; i < d->count; i++, data += d->size)
+		v[i] = (4 == d->size) ? B4F(data, d->factor) : B3F(data, d->factor);
 
-	return checkResult;
+	return data;
 }
 
-// Get current (I) by phases
-int getI(int ttyd, P3V* I)
+// -- Build the request of the poll cycle step into frame (BSZ bytes)
+// -- Returns the request size, respLen gets the responce size expected.
+int stepRequest(int step, byte addr, byte* frame, int* respLen)
 {
-	ReadParamCmd getICmd =
+	const StepDesc* d = &stepDesc[step];
+	*respLen = stepRespLen(d);
+	switch(d->command)
 	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x21
-	};
-	getICmd.CRC = ModRTU_CRC((byte*)&getICmd, sizeof(getICmd) - sizeof(UInt16));
-	printPackage((byte*)&getICmd, sizeof(getICmd), OUT);
+		case 0x00:	// test connection
+		case 0x02:	// connection termination
+			return shortCmd(frame, addr, d->command);
 
-	write(ttyd, (byte*)&getICmd, sizeof(getICmd));
-	usleep(TIME_OUT);
+		case 0x01:
+			return initCmd(frame, addr);
 
-	// Read responce
-	byte buf[BSZ];
-	int len = nb_read(ttyd, buf, BSZ);
-	printPackage((byte*)buf, len, IN);
-
-	// Check and decode result
-	int checkResult = checkResult_3x3b(buf, len);
-	if (OK == checkResult)
-	{
-		Result_3x3b* res = (Result_3x3b*)buf;
-		I->p1 = B3F(res->p1, 1000.0);
-		I->p2 = B3F(res->p2, 1000.0);
-		I->p3 = B3F(res->p3, 1000.0);
+		default:
+			return readParamCmd(frame, addr, d->command, d->paramId, d->BWRI);
 	}
-
-	return checkResult;
 }
 
-// Get power consumption factor cos(f) by phases
-int getCosF(int ttyd, P3VS* C)
+// -- Build the request frames of all the poll cycle steps of the meter
+void buildPlan(Meter* meter)
 {
-	ReadParamCmd getCosCmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x30
-	};
-	getCosCmd.CRC = ModRTU_CRC((byte*)&getCosCmd, sizeof(getCosCmd) - sizeof(UInt16));
-	printPackage((byte*)&getCosCmd, sizeof(getCosCmd), OUT);
+	int respLen, off = 0;
 
-	write(ttyd, (byte*)&getCosCmd, sizeof(getCosCmd));
-	usleep(TIME_OUT);
+	for (int step = 0; step < STEP_NUM; step++)
+		off += stepRequest(step, meter->address, meter->plan + off, &respLen);
+	meter->planned = 1;
+}
 
-	// Read responce
-	byte buf[BSZ];
-	int len = nb_read(ttyd, buf, BSZ);
-	printPackage((byte*)buf, len, IN);
+// -- Request frame of the poll cycle step, the frames are built on the first use and the address change only
+// -- Returns the frame within the meter plan, len gets its size.
+byte* stepFrame(Meter* meter, int step, int* len)
+{
+	int off = 0;
 
-	// Check and decode result
-	int checkResult = checkResult_4x3b(buf, len);
-	if (OK == checkResult)
-	{
-		Result_4x3b* res = (Result_4x3b*)buf;
-		C->p1 = B3F(res->p1, 1000.0);
-		C->p2 = B3F(res->p2, 1000.0);
-		C->p3 = B3F(res->p3, 1000.0);
-		C->sum = B3F(res->sum, 1000.0);
-	}
+	if (!meter->planned || meter->plan[0] != meter->address)
+		buildPlan(meter);
 
-	return checkResult;
+	for (int s = 0; s < step; s++)
+		off += stepReqLen[s];
+	*len = stepReqLen[step];
+	return meter->plan + off;
 }
 
-// Get grid frequency (Hz)
-int getF(int ttyd, float *f)
+// -- Decode the values of the poll cycle step responce checked into the output block
+void stepValues(int step, byte* buf, OutputBlock* o)
 {
-	ReadParamCmd getFCmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x40
-	};
-	getFCmd.CRC = ModRTU_CRC((byte*)&getFCmd, sizeof(getFCmd) - sizeof(UInt16));
-	printPackage((byte*)&getFCmd, sizeof(getFCmd), OUT);
-
-	write(ttyd, (byte*)&getFCmd, sizeof(getFCmd));
-	usleep(TIME_OUT);
+	const StepDesc* d = &stepDesc[step];
+	byte* data = buf + 1;
+
+	if (d->parts)
+		for (const int* part = d->parts; *part != STEP_NUM; part++)
+			data = decodeValues(&stepDesc[*part], data, o);
+	else
+		decodeValues(d, data, o);
+}
 
-	// Read responce
-	byte buf[BSZ];
-	int len = nb_read(ttyd, buf, BSZ);
-	printPackage((byte*)buf, len, IN);
+// -- Check and decode the responce of the poll cycle step into the output block
+int stepDecode(int step, byte* buf, int len, OutputBlock* o)
+{
+	const StepDesc* d = &stepDesc[step];
 
-	// Check and decode result
-	int checkResult = checkResult_3b(buf, len);
-	if (OK == checkResult)
-	{
-		Result_3b* res = (Result_3b*)buf;
-		*f = B3F(res->res, 100.0);
-	}
+	int checkResult = checkResponce(buf, len, stepRespLen(d));
+	if (OK == checkResult && d->count)
+		stepValues(step, buf, o);
 
 	return checkResult;
 }
 
-// Get phases angle
-int getA(int ttyd, P3V* A)
+// -- Debug message of the meter poll: passed to the meter log receiver if set, printed with --debug otherwise
+void meterDebug(Meter* meter, const char* format, ...)
 {
-	ReadParamCmd getACmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x51
-	};
-	getACmd.CRC = ModRTU_CRC((byte*)&getACmd, sizeof(getACmd) - sizeof(UInt16));
-	printPackage((byte*)&getACmd, sizeof(getACmd), OUT);
+	char msg[BSZ];
+	va_list args;
 
-	write(ttyd, (byte*)&getACmd, sizeof(getACmd));
-	usleep(TIME_OUT);
+	if (!meter->log && !debugPrint)
+		return;
 
-	// Read responce
-	byte buf[BSZ];
-	int len = nb_read(ttyd, buf, BSZ);
-	printPackage((byte*)buf, len, IN);
-
-	// Check and decode result
-	int checkResult = checkResult_3x3b(buf, len);
-	if (OK == checkResult)
-	{
-		Result_3x3b* res = (Result_3x3b*)buf;
-		A->p1 = B3F(res->p1, 100.0);
-		A->p2 = B3F(res->p2, 100.0);
-		A->p3 = B3F(res->p3, 100.0);
-	}
+	va_start(args, format);
+	vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
 
-	return checkResult;
+	if (meter->log)
+		meter->log(meter->address, msg);
+	else
+		printf("%s\n\r", msg);
 }
 
-// Get active power (W) consumption by phases with total
-int getP(int ttyd, P3VS* P)
-{
-	ReadParamCmd getPCmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x00
-	};
-	getPCmd.CRC = ModRTU_CRC((byte*)&getPCmd, sizeof(getPCmd) - sizeof(UInt16));
-	printPackage((byte*)&getPCmd, sizeof(getPCmd), OUT);
-
-	write(ttyd, (byte*)&getPCmd, sizeof(getPCmd));
-	usleep(TIME_OUT);
+int auxPlanned(Meter* meter);
 
-	// Read responce
-	byte buf[BSZ];
-	int len = nb_read(ttyd, buf, BSZ);
-	printPackage((byte*)buf, len, IN);
+// -- Plan the data steps of the poll cycle for the groups due
+// -- The choice is made once per cycle: the step costs change with every transaction accounted.
+void planCycle(Meter* meter)
+{
+	meter->auxDue = auxPlanned(meter);
+}
 
-	// Check and decode result
-	int checkResult = checkResult_4x3b(buf, len);
-	if (OK == checkResult)
-	{
-		Result_4x3b* res = (Result_4x3b*)buf;
-		P->p1 = B3F(res->p1, 100.0);
-		P->p2 = B3F(res->p2, 100.0);
-		P->p3 = B3F(res->p3, 100.0);
-		P->sum = B3F(res->sum, 100.0);
-	}
+// -- Start the poll cycle: pick the parameter groups with their period elapsed
+void startCycle(Meter* meter, time_t now)
+{
+	meter->cycleStarted = now;
+	meter->due = 0;
 
-	return checkResult;
+	for (int g = 0; g < GROUP_NUM; g++)
+		if (now - meter->updated[g] >= groupPeriod[g])
+			meter->due |= 1 << g;
+	planCycle(meter);
 }
 
-// Get reactive power (VA) consumption by phases with total
-int getS(int ttyd, P3VS* S)
+// -- Check if the data step values are due within the poll cycle and selected
+int stepWanted(Meter* meter, int step)
 {
-	ReadParamCmd getSCmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x08,
-		.paramId = 0x16,
-		.BWRI = 0x08
-	};
-	getSCmd.CRC = ModRTU_CRC((byte*)&getSCmd, sizeof(getSCmd) - sizeof(UInt16));
-	printPackage((byte*)&getSCmd, sizeof(getSCmd), OUT);
+	int fields = meter->fields ? meter->fields : wantedFields;
 
-	write(ttyd, (byte*)&getSCmd, sizeof(getSCmd));
-	usleep(TIME_OUT);
+	return (meter->due & stepDesc[step].groups) && (fields & FIELD_BIT(step));
+}
 
-	// Read responce
-	byte buf[BSZ];
-	int len = nb_read(ttyd, buf, BSZ);
-	printPackage((byte*)buf, len, IN);
+// -- Estimated transaction time of the step with the meter (ms): its measured turnaround and the frames transfer
+double stepCost(Meter* meter, int step)
+{
+	const TxStats* s = &meter->stats;
+	long count = txTimed(s);
 
-	// Check and decode result
-	int checkResult = checkResult_4x3b(buf, len);
-	if (OK == checkResult)
-	{
-		Result_4x3b* res = (Result_4x3b*)buf;
-		S->p1 = B3F(res->p1, 100.0);
-		S->p2 = B3F(res->p2, 100.0);
-		S->p3 = B3F(res->p3, 100.0);
-		S->sum = B3F(res->sum, 100.0);
-	}
+	double turnaround = count ? s->turnaround / count : DEF_TURNAROUND;
+	int bytes = sizeof(ReadParamCmd) + stepRespLen(&stepDesc[step]);
+	int baud = meter->baud ? meter->baud : portBaud;
 
-	return checkResult;
+	return turnaround + bytes * 10 * 1000.0 / (baud ? baud : BAUDRATE_BPS);
 }
 
-/* Get power counters by phases for the period
-	periodId - one of PowerPeriod enum values
-	month - month number when periodId is PP_MONTH
-	tariffNo - 0 for all tariffs, 1 - tariff #1, 2 - tariff #2 etc. */
-int getW(int ttyd, PWV* W, int periodId, int month, int tariffNo)
+// -- Check if the auxiliary parameters array read is cheaper than the per-parameter reads of the values due
+int auxPlanned(Meter* meter)
 {
-	ReadParamCmd getWCmd =
-	{
-		.address = PM_ADDRESS,
-		.command = 0x05,
-		.paramId = (periodId << 4) | (month & 0xF),
-		.BWRI = tariffNo
-	};
-	getWCmd.CRC = ModRTU_CRC((byte*)&getWCmd, sizeof(getWCmd) - sizeof(UInt16));
-	printPackage((byte*)&getWCmd, sizeof(getWCmd), OUT);
+	double separate = 0;
 
-	write(ttyd, (byte*)&getWCmd, sizeof(getWCmd));
-	usleep(TIME_OUT);
+	if (meter->noAuxArray)
+		return 0;
 
-	// Read responce
-	byte buf[BSZ];
-	int len = nb_read(ttyd, buf, BSZ);
-	printPackage((byte*)buf, len, IN);
+	for (const int* part = stepDesc[STEP_AUX].parts; *part != STEP_NUM; part++)
+		if (stepWanted(meter, *part))
+			separate += stepCost(meter, *part);
 
-	// Check and decode result
-	int checkResult = checkResult_4x4b(buf, len);
-	if (OK == checkResult)
-	{
-		Result_4x4b* res = (Result_4x4b*)buf;
-		W->ap = B4F(res->ap, 1000.0);
-		W->am = B4F(res->am, 1000.0);
-		W->rp = B4F(res->rp, 1000.0);
-		W->rm = B4F(res->rm, 1000.0);
+	return separate && stepCost(meter, STEP_AUX) <= separate;
+}
+
+// -- Check if the data step is to be run within the poll cycle
+// -- The array read replaces the per-parameter reads when it takes less time (see planCycle).
+int stepDue(Meter* meter, int step)
+{
+	if (STEP_AUX == step)
+		return meter->auxDue;
+	if ((stepDesc[step].groups & AUX_GROUPS) && meter->auxDue)
+		return 0;
+
+	return stepWanted(meter, step);
+}
+
+// -- Next data step due after the one given, STEP_CLOSE after the last one
+int nextDataStep(Meter* meter, int step)
+{
+	do
+		step++;
+	while (STEP_CLOSE != step && !stepDue(meter, step));
+
+	return step;
+}
+
+// -- First data step due within the poll cycle, STEP_CLOSE if none
+int firstDataStep(Meter* meter)
+{
+	return nextDataStep(meter, STEP_INIT);
+}
+
+// -- Output fields validity bits of the data step
+int stepFields(int step)
+{
+	int fields = 0;
+
+	if (stepDesc[step].parts)
+		for (const int* part = stepDesc[step].parts; *part != STEP_NUM; part++)
+			fields |= FIELD_BIT(*part);
+	else if (stepDesc[step].count)
+		fields = FIELD_BIT(step);
+
+	return fields;
+}
+
+// -- The data step has succeeded, its parameter groups are up to date
+void stepDone(Meter* meter, int step)
+{
+	for (int g = 0; g < GROUP_NUM; g++)
+		if (stepDesc[step].groups & (1 << g))
+			meter->updated[g] = meter->cycleStarted;
+	meter->valid |= stepFields(step);
+}
+
+// -- The data step has failed after the retries, its fields keep the previous values marked invalid
+void stepFailed(Meter* meter, int step)
+{
+	meterDebug(meter, "Power meter #%d: %s", meter->address, stepDesc[step].failure);
+	meter->valid &= ~stepFields(step);
+}
+
+// -- Data step reading the output block value at the offset given, STEP_NUM if none
+int fieldStep(size_t field)
+{
+	for (int step = STEP_U; step < STEP_CLOSE; step++)
+	{
+		const StepDesc* d = &stepDesc[step];
+		if (field >= d->field && field < d->field + d->count * sizeof(float))
+			return step;
+	}
+
+	return STEP_NUM;
+}
+
+// -- Check if the output block value at the offset given holds the value read
+int fieldValid(Meter* meter, size_t field)
+{
+	int step = fieldStep(field);
+
+	return STEP_NUM != step && (meter->valid & FIELD_BIT(step)) != 0;
+}
+
+// -- Parse comma-separated list of the output values: NAME.SUB or NAME for all its values (e.g. P.sum,U)
+// -- The values are selected once in the list order, the data steps reading them are planned.
+// -- Returns 0 if the list is invalid.
+int parseFields(const char* list)
+{
+	char name[BSZ];
+
+	selectedNum = 0;
+	wantedFields = 0;
+	while (*list)
+	{
+		size_t len = strcspn(list, ",");
+		if (!len || len >= sizeof(name))
+			return 0;
+		memcpy(name, list, len);
+		name[len] = 0;
+		list += len + (',' == list[len]);
+
+		int found = 0;
+		for (int i = 0; i < OUTPUT_FIELDS; i++)
+		{
+			const char* n = outputFields[i].name;
+			if (strncmp(n, name, len) || (n[len] && '.' != n[len]))
+				continue;
+			found = 1;
+
+			int dup = 0;
+			for (int j = 0; j < selectedNum; j++)
+				dup |= (selectedFields[j] == i);
+			if (!dup)
+				selectedFields[selectedNum++] = i;
+			wantedFields |= FIELD_BIT(fieldStep(outputFields[i].field));
+		}
+		if (!found)
+			return 0;
+	}
+
+	return selectedNum;
+}
+
+// -- Responce timeout of the step transaction with the meter (mks), STEP_NUM for the commands out of the poll cycle
+// -- The meter cut off by the breaker is probed with the short channel test.
+long responceTimeout(Meter* meter, int step)
+{
+	long ms = (step < STEP_NUM && stepTimeout[step]) ? stepTimeout[step] : cmdTimeout;
+
+	if (STEP_CHECK == step && meter->probeDelay && ms > PROBE_TIME_OUT)
+		ms = PROBE_TIME_OUT;
+
+	return ms * 1000;
+}
+
+// -- Account the transaction answered or timed out after all the retries in the meter health
+// -- breakerTimeouts consecutive timeouts cut the meter off: it is just probed with the channel test
+// -- at the growing intervals then until it answers again.
+void meterHealth(Meter* meter, int answered)
+{
+	if (answered)
+	{
+		if (meter->probeDelay)
+			meterDebug(meter, "Power meter #%d answers again.", meter->address);
+		meter->timeouts = 0;
+		meter->probeDelay = 0;
+		return;
+	}
+
+	if (!breakerTimeouts || ++meter->timeouts < breakerTimeouts)
+		return;
+
+	// Cut off or the probe has failed
+	meter->probeDelay = !meter->probeDelay ? PROBE_DELAY :
+		(meter->probeDelay * 2 < PROBE_DELAY_MAX) ? meter->probeDelay * 2 : PROBE_DELAY_MAX;
+	meter->probeAt = time(NULL) + meter->probeDelay;
+
+	meterDebug(meter, "Power meter #%d is cut off, next probe in %d s.", meter->address, meter->probeDelay);
+}
+
+// -- Check if the meter is to be tried: not cut off by the breaker or its probe is due
+int probeDue(Meter* meter, time_t now)
+{
+	return !meter->probeDelay || now >= meter->probeAt;
+}
+
+// -- Parse the responce timeouts (ms): comma-separated list of N for all the steps or STEP=N
+// -- Returns 0 if the list is invalid.
+int parseTimeouts(const char* list)
+{
+	char* end;
+
+	do
+	{
+		int step = 0;
+		while (step < STEP_NUM && (strncmp(list, stepName[step], strlen(stepName[step])) || list[strlen(stepName[step])] != '='))
+			step++;
+		if (step < STEP_NUM)
+			list += strlen(stepName[step]) + 1;
+
+		long ms = strtol(list, &end, 10);
+		if (end == list || ms <= 0)
+			return 0;
+
+		if (step < STEP_NUM)
+			stepTimeout[step] = ms;
+		else
+			cmdTimeout = ms;
+		list = end + 1;
+	}
+	while (*end == ',');
+
+	return !*end;
+}
+
+// -- Check if the failed transaction is worth retrying: the frame is garbled or lost
+int retryable(int step, int result)
+{
+	return WRONG_CRC == result || WRONG_RESULT_SIZE == result ||
+		(CHECK_CHANNEL_TIME_OUT == result && STEP_CHECK != step);
+}
+
+// -- Check if the auxiliary parameters array read has failed: the per-parameter reads follow within the cycle
+// -- The per-parameter reads are used from now on for the meter firmware rejecting the array read
+// -- or answering it with another layout: AUX_WRONG_SIZE consecutive responces of the wrong size after the retries.
+int auxArrayFailed(Meter* meter, int step, int result)
+{
+	if (STEP_AUX != step)
+		return 0;
+	if (OK == result)
+	{
+		meter->auxWrongSize = 0;
+		return 0;
+	}
+
+	if (ILLEGAL_CMD == result)
+	{
+		meterDebug(meter, "Power meter #%d rejects the auxiliary parameters array read.", meter->address);
+		meter->noAuxArray = 1;
+	}
+	else if (WRONG_RESULT_SIZE == result && ++meter->auxWrongSize >= AUX_WRONG_SIZE)
+	{
+		meterDebug(meter, "Power meter #%d answers the auxiliary parameters array read with another layout.", meter->address);
+		meter->noAuxArray = 1;
+	}
+	meter->auxDue = 0;
+
+	return 1;
+}
+
+// -- Run the request / responce transaction with the meter, it is accounted in the meter statistics
+// -- The responce of respLen bytes expected is received into buf (BSZ bytes).
+// -- step gives the responce timeout and the retry rules, STEP_NUM for the commands out of the poll cycle.
+// -- Garbled and lost frames are retried up to txRetries times after the growing backoff.
+// -- Returns the responce check result, CHECK_CHANNEL_TIME_OUT if the meter doesn't answer.
+int transact(int ttyd, Meter* meter, int step, byte* frame, int len, byte* buf, int respLen)
+{
+	int r;
+	Frame f;
+
+	for (int retry = 0; ; retry++)
+	{
+		frameStart(&f, buf, respLen);
+		sendCmd(ttyd, frame, len, &f);
+
+		// Get responce
+		int got = nb_read_impl(ttyd, &f, responceTimeout(meter, step));
+		if (got)
+		{
+			printPackage(buf, got, IN);
+			r = checkResponce(buf, got, respLen);
+		}
+		else
+			r = CHECK_CHANNEL_TIME_OUT;
+		txRecord(&meter->stats, &f, r);
+
+		if (retry == txRetries || !retryable(step, r))
+			break;
+
+		if (debugPrint)
+			printf("Retrying the transaction...\n\r");
+
+		// The late bytes of the failed responce are dropped
+		usleep(RETRY_BACKOFF << retry);
+		tcflush(ttyd, TCIFLUSH);
+	}
+
+	// The breaker counts the transactions, not the retry attempts
+	meterHealth(meter, CHECK_CHANNEL_TIME_OUT != r);
+
+	return r;
+}
+
+// -- Run the transaction of the poll cycle step with the meter
+// -- Returns the transaction result: CHECK_CHANNEL_TIME_OUT if the meter doesn't answer.
+int runStep(int ttyd, Meter* meter, int step)
+{
+	byte buf[BSZ];
+	int len;
+
+	byte* frame = stepFrame(meter, step, &len);
+	int r = transact(ttyd, meter, step, frame, len, buf, stepRespLen(&stepDesc[step]));
+
+	if (OK == r && stepDesc[step].count)
+		stepValues(step, buf, &meter->o);
+
+	return r;
+}
+
+// -- Check the communication channel
+int checkChannel(int ttyd, Meter* meter)
+{
+	return runStep(ttyd, meter, STEP_CHECK);
+}
+
+// -- Connection initialisation
+int initConnection(int ttyd, Meter* meter)
+{
+	return runStep(ttyd, meter, STEP_INIT);
+}
+
+// -- Close connection
+int closeConnection(int ttyd, Meter* meter)
+{
+	return runStep(ttyd, meter, STEP_CLOSE);
+}
+
+// -- Next transaction of the meter poll after the step result
+// -- The sessions are kept open after the data steps if keepSession is set.
+// -- Returns the next step, STEP_NUM if the meter poll is over, -1 if it has failed (see the step failure message).
+int pollNext(Meter* meter, int step, int result, int keepSession, int* reconnected)
+{
+	switch(step)
+	{
+		case STEP_CHECK:
+		case STEP_INIT:
+			if (OK != result)
+				return -1;
+			meter->online = (STEP_INIT == step);
+			step = meter->online ? firstDataStep(meter) : STEP_INIT;
+			break;
+
+		case STEP_CLOSE:
+			meter->online = 0;
+			return STEP_NUM;
+
+		default:
+			if (CHANNEL_ISNT_OPEN == result)
+			{
+				if (*reconnected)
+					return -1;
+				meterDebug(meter, "Power meter #%d session is closed, reconnecting...", meter->address);
+				*reconnected = 1;
+				return STEP_INIT;
+			}
+
+			// The values of the array failed are read by the per-parameter steps
+			if (auxArrayFailed(meter, step, result))
+			{
+				step = firstDataStep(meter);
+				break;
+			}
+
+			// The fields of the step failed after the retries are marked invalid, the rest are still read
+			if (OK == result)
+				stepDone(meter, step);
+			else
+				stepFailed(meter, step);
+			step = nextDataStep(meter, step);
+	}
+
+	return (STEP_CLOSE == step && keepSession) ? STEP_NUM : step;
+}
+
+// -- Poll the meter with the blocking transactions: the step sequence is the reactor one (see pollNext)
+// -- The session is opened if needed and kept open after the data reads if keepSession is set.
+// -- Returns OK, CHECK_CHANNEL_TIME_OUT if the meter doesn't answer or the failed step result (see meter->failure).
+int pollMeter(int ttyd, Meter* meter, int keepSession)
+{
+	int reconnected = 0;
+
+	meter->failure = NULL;
+	startCycle(meter, time(NULL));
+
+	int step = meter->online ? firstDataStep(meter) : STEP_CHECK;
+	if (STEP_CLOSE == step && keepSession)
+		return OK;
+
+	for (;;)
+	{
+		int r = runStep(ttyd, meter, step);
+		int next = 0;
+		if (CHECK_CHANNEL_TIME_OUT == r)
+		{
+			if (STEP_CHECK != step)
+				fprintf(stderr, "Power meter #%d: communication channel timeout.\n", meter->address);
+			else if (debugPrint)
+				printf("Power meter #%d doesn't answer.\n\r", meter->address);
+			meter->failure = "Power meter doesn't answer.";
+		}
+		else if ((next = pollNext(meter, step, r, keepSession, &reconnected)) < 0)
+			meter->failure = stepDesc[step].failure;
+		else if (STEP_NUM == next)
+			return OK;
+		else
+		{
+			step = next;
+			continue;
+		}
+
+		// The session is lost on the failure within it, the meter is probed again as the one not answering
+		bzero(&meter->o, sizeof(OutputBlock));
+		bzero(meter->updated, sizeof(meter->updated));
+		meter->valid = 0;
+		meter->online = 0;
+		return r;
+	}
+}
+
+// -- Check the channel and open the session with the meter
+// -- Returns CHECK_CHANNEL_TIME_OUT if the meter doesn't answer, aborts on other errors.
+int openSession(int ttyd, Meter* meter)
+{
+	int r = checkChannel(ttyd, meter);
+	switch(r)
+	{
+		case OK:
+			r = initConnection(ttyd, meter);
+			if (CHECK_CHANNEL_TIME_OUT == r)
+				fprintf(stderr, "Power meter #%d: communication channel timeout.\n", meter->address);
+			else if (OK != r)
+				exitFailure("Power meter connection initialisation error.");
+			break;
+
+		case CHECK_CHANNEL_TIME_OUT:
+			if (debugPrint)
+				printf("Power meter #%d doesn't answer.\n\r", meter->address);
+			break;
+
+		default:
+			exitFailure("Power meter communication channel test failed.");
+	}
+
+	return r;
+}
+
+// -- Check if the meter answers the channel test at the current port speed
+// -- Just the short probe is made: no retries, no statistics.
+int probeBaud(int fd, Meter* meter)
+{
+	byte buf[BSZ];
+	int len;
+	Frame f;
+
+	byte* frame = stepFrame(meter, STEP_CHECK, &len);
+	frameStart(&f, buf, stepRespLen(&stepDesc[STEP_CHECK]));
+	sendCmd(fd, frame, len, &f);
+
+	len = nb_read_impl(fd, &f, PROBE_TIME_OUT * 1000L);
+	printPackage(buf, len, IN);
+
+	return len && OK == stepDecode(STEP_CHECK, buf, len, NULL);
+}
+
+// -- Check if any of the meters on the port answers at the current port speed: probed in turn until one does
+int probeMeters(int fd, Meter* meters, int meterNum)
+{
+	for (int m = 0; m < meterNum; m++)
+		if (probeBaud(fd, &meters[m]))
+			return 1;
+
+	return 0;
+}
+
+// -- Set up the port speed: the --baud one or autodetected with the channel test of the meters
+// -- The rate detected is cached for the port, the cached one is tried first next time.
+// -- Returns the rate set, the default one if no meter answers at any.
+int portSpeed(int fd, const char* dev, Meter* meters, int meterNum)
+{
+	if (BAUD_AUTO != baudRate)
+	{
+		setBaud(fd, baudRate);
+		return baudRate;
+	}
+
+	int cached = cachedBaud(dev);
+	if (cached)
+	{
+		setBaud(fd, cached);
+		if (probeMeters(fd, meters, meterNum))
+			return cached;
+	}
+
+	for (const BaudRate* b = baudRates; b->bps; b++)
+	{
+		if (b->bps == cached)
+			continue;
+
+		if (debugPrint)
+			printf("Trying %d baud...\n\r", b->bps);
+		setBaud(fd, b->bps);
+		if (probeMeters(fd, meters, meterNum))
+		{
+			saveBaud(dev, b->bps);
+			return b->bps;
+		}
+	}
+
+	fprintf(stderr, "%s: no power meter answers at any baud rate, %d is used\n", dev, BAUDRATE_BPS);
+	setBaud(fd, BAUDRATE_BPS);
+	return BAUDRATE_BPS;
+}
+
+// -- Decode BCD byte
+int BCD(byte b)
+{
+	return (b >> 4) * 10 + (b & 0x0F);
+}
+
+// -- Local time of the profile record: hour, minute, day, month, year (BCD)
+// -- Returns -1 if the record is empty or damaged.
+time_t profileTime(byte t[5])
+{
+	struct tm tm;
+
+	bzero(&tm, sizeof(tm));
+	tm.tm_hour = BCD(t[0]);
+	tm.tm_min = BCD(t[1]);
+	tm.tm_mday = BCD(t[2]);
+	tm.tm_mon = BCD(t[3]) - 1;
+	tm.tm_year = BCD(t[4]) + 100;
+	tm.tm_isdst = -1;
+
+	if (tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_mon < 0 || tm.tm_mon > 11)
+		return -1;
+
+	return mktime(&tm);
+}
+
+// -- Parse the local time: YYYY-MM-DD[THH:MM]
+// -- Returns -1 if invalid.
+time_t parseTime(const char* str)
+{
+	struct tm tm;
+	int n;
+
+	bzero(&tm, sizeof(tm));
+	if (sscanf(str, "%d-%d-%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n) != 3)
+		return -1;
+	if (str[n] && sscanf(str + n, "T%d:%d%n", &tm.tm_hour, &tm.tm_min, &n) != 2)
+		return -1;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+	tm.tm_isdst = -1;
+
+	return mktime(&tm);
+}
+
+// -- Read the meter serial number (parameter 00h: 4 bytes by 2 digits, production date)
+// -- Returns the result: CHECK_CHANNEL_TIME_OUT if the meter doesn't answer.
+int readSerial(int ttyd, Meter* meter, char* serial)
+{
+	byte frame[BSZ], buf[BSZ];
+
+	int len = readParamCmd(frame, meter->address, 0x08, 0x00, 0x00);
+	int r = transact(ttyd, meter, STEP_NUM, frame, len, buf, 1 + 7 + sizeof(UInt16));
+
+	if (OK == r)
+		sprintf(serial, "%02d%02d%02d%02d", buf[1] % 100, buf[2] % 100, buf[3] % 100, buf[4] % 100);
+	return r;
+}
+
+// -- Read the last load profile record pointer
+// -- Returns the result: CHECK_CHANNEL_TIME_OUT if the meter doesn't answer.
+int readProfilePointer(int ttyd, Meter* meter, ProfilePointer* ptr)
+{
+	byte frame[BSZ], buf[BSZ];
+
+	int len = readParamCmd(frame, meter->address, 0x08, 0x13, 0x00);
+	int r = transact(ttyd, meter, STEP_NUM, frame, len, buf, 1 + sizeof(ProfilePointer) + sizeof(UInt16));
+
+	if (OK == r)
+		memcpy(ptr, buf + 1, sizeof(ProfilePointer));
+	return r;
+}
+
+// -- Read the load profile records from the memory address given into records
+// -- Returns the result: CHECK_CHANNEL_TIME_OUT if the meter doesn't answer.
+int readProfileBlock(int ttyd, Meter* meter, int addr, int count, ProfileRecord* records)
+{
+	byte frame[BSZ], buf[BSZ];
+	int size = count * sizeof(ProfileRecord);
+
+	int len = readMemCmd(frame, meter->address, PROFILE_MEMORY, addr, size);
+	int r = transact(ttyd, meter, STEP_NUM, frame, len, buf, 1 + size + sizeof(UInt16));
+
+	if (OK == r)
+		memcpy(records, buf + 1, size);
+	return r;
+}
+
+// -- Format the average power of the profile value (kW or kvar), empty if not recorded
+const char* profilePower(char* str, UInt16 v, int period, int constant)
+{
+	if (PROFILE_NONE == v)
+		*str = 0;
+	else
+		sprintf(str, "%.3f", v * 60.0 / period / (2.0 * constant));
+	return str;
+}
+
+// -- Print the load profile record
+void printProfileRecord(FILE* out, int format, Meter* meter, int showAddress, time_t t, ProfileRecord* rec, int constant)
+{
+	char timeStamp[BSZ], v[4][32];
+
+	getDateTimeStr(timeStamp, BSZ, t);
+	profilePower(v[0], rec->P[0], rec->period, constant);
+	profilePower(v[1], rec->P[1], rec->period, constant);
+	profilePower(v[2], rec->Q[0], rec->period, constant);
+	profilePower(v[3], rec->Q[1], rec->period, constant);
+
+	switch(format)
+	{
+		case OF_HUMAN:
+			if (showAddress)
+				fprintf(out, "#%d ", meter->address);
+			fprintf(out, "%s %3d min  P+ %10s kW  P- %10s kW  Q+ %10s kvar  Q- %10s kvar\n\r",
+				timeStamp, rec->period, v[0], v[1], v[2], v[3]);
+			break;
+
+		case OF_CSV:
+			fprintf(out, "%s,", timeStamp);
+			if (showAddress)
+				fprintf(out, "%d,", meter->address);
+			fprintf(out, "%d,%s,%s,%s,%s\n\r", rec->period, v[0], v[1], v[2], v[3]);
+			break;
+
+		case OF_JSON:
+			fprintf(out, "{\"DT\":\"%s\",", timeStamp);
+			if (showAddress)
+				fprintf(out, "\"Addr\":%d,", meter->address);
+			fprintf(out, "\"Period\":%d,\"P+\":%s,\"P-\":%s,\"Q+\":%s,\"Q-\":%s}\n\r", rec->period,
+				*v[0] ? v[0] : "null", *v[1] ? v[1] : "null", *v[2] ? v[2] : "null", *v[3] ? v[3] : "null");
+			break;
+	}
+}
+
+// -- Read n load profile records from the memory address given and print the ones from the time range given
+// -- The records are read in the blocks as large as the meter accepts, starting from PROFILE_BLOCK records.
+// -- The progress (if given) is moved to the last record read.
+// -- Returns the number of records printed, -1 if the meter has failed.
+int readProfileRecords(int ttyd, Meter* meter, int addr, long n, time_t from, time_t to,
+	int format, int showAddress, int constant, ProfileCursor* progress)
+{
+	ProfileRecord records[PROFILE_BLOCK];
+	int printed = 0, block = PROFILE_BLOCK;
+
+	while (n > 0)
+	{
+		// The block doesn't wrap round the memory end
+		int count = (n < block) ? n : block;
+		if (addr + count * sizeof(ProfileRecord) > PROFILE_SIZE)
+			count = (PROFILE_SIZE - addr) / sizeof(ProfileRecord);
+
+		int r = readProfileBlock(ttyd, meter, addr, count, records);
+		if (OK != r)
+		{
+			// The meter rejects the blocks that large (the garbled responces are retried within the transaction)
+			if (ILLEGAL_CMD == r && block > 1)
+			{
+				block = (count > 1) ? count / 2 : 1;
+				if (debugPrint)
+					printf("Power meter #%d: profile read block is reduced to %d records.\n\r", meter->address, block);
+				continue;
+			}
+			return -1;
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			time_t t = profileTime(records[i].time);
+			if (t >= from && t <= to && records[i].period)
+			{
+				printProfileRecord(stdout, format, meter, showAddress, t, &records[i], constant);
+				printed++;
+			}
+			if (progress && t >= 0 && records[i].period)
+			{
+				progress->addr = addr + i * sizeof(ProfileRecord);
+				progress->time = t;
+			}
+		}
+		fflush(stdout);
+
+		n -= count;
+		addr = (addr + count * sizeof(ProfileRecord)) % PROFILE_SIZE;
+	}
+
+	return printed;
+}
+
+// -- Download the load profile records from the time range given and print them as they come
+// -- The memory is walked back from the last record by the integration periods, so the gaps of the profile
+// -- (e.g. power outages) just make it read a few extra records.
+// -- Returns the number of records printed, -1 if the meter has failed.
+int readProfile(int ttyd, Meter* meter, time_t from, time_t to, int format, int showAddress, int constant)
+{
+	ProfilePointer ptr;
+
+	if (OK != readProfilePointer(ttyd, meter, &ptr))
+		return -1;
+
+	time_t last = profileTime(ptr.time);
+	int lastAddr = (ptr.addrHi << 8) | ptr.addrLo;
+	if (last < 0 || !ptr.period)
+		return 0;
+	if (from > last)
+		return 0;
+
+	long n = (last - from) / (ptr.period * 60) + 1;
+	if (n > PROFILE_SIZE / sizeof(ProfileRecord))
+		n = PROFILE_SIZE / sizeof(ProfileRecord);
+	int addr = (lastAddr - (n - 1) * sizeof(ProfileRecord) + PROFILE_SIZE) % PROFILE_SIZE;
+
+	return readProfileRecords(ttyd, meter, addr, n, from, to, format, showAddress, constant, NULL);
+}
+
+// -- Last profile record fetched from the meter before, the cursor address is -1 if none
+void loadCursor(const char* serial, ProfileCursor* cursor)
+{
+	char line[BSZ], s[BSZ];
+	int addr;
+	long long t;
+
+	bzero(cursor, sizeof(ProfileCursor));
+	snprintf(cursor->serial, sizeof(cursor->serial), "%s", serial);
+	cursor->addr = -1;
+
+	FILE* f = fopen(PROFILE_CURSORS, "r");
+	if (!f)
+		return;
+
+	while (cursor->addr < 0 && fgets(line, sizeof(line), f))
+		if (3 == sscanf(line, "%254s %d %lld", s, &addr, &t) && !strcmp(s, serial) && addr >= 0 && addr < PROFILE_SIZE)
+		{
+			cursor->addr = addr;
+			cursor->time = t;
+		}
+	fclose(f);
+}
+
+// -- Keep the last profile record fetched from the meter, the other meters entries are kept as well
+void saveCursor(ProfileCursor* cursor)
+{
+	char line[BSZ], s[BSZ], tmp[BSZ];
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", PROFILE_CURSORS, getpid());
+	FILE* out = fopen(tmp, "w");
+	if (!out)
+		return;
+
+	FILE* f = fopen(PROFILE_CURSORS, "r");
+	if (f)
+	{
+		while (fgets(line, sizeof(line), f))
+			if (1 == sscanf(line, "%254s", s) && strcmp(s, cursor->serial))
+				fputs(line, out);
+		fclose(f);
+	}
+	fprintf(out, "%s %d %lld\n", cursor->serial, cursor->addr, (long long)cursor->time);
+	fclose(out);
+
+	rename(tmp, PROFILE_CURSORS);
+}
+
+// -- Download the load profile records newer than the ones fetched by the previous sync and print them
+// -- The cursor is kept by the meter serial number, so the meters could be readdressed or moved between the buses.
+// -- The whole profile memory is read if the meter pointer has gone round past the cursor or moved back
+// -- (the profile was reset or the clock set back).
+// -- Returns the number of records printed, -1 if the meter has failed.
+int syncProfile(int ttyd, Meter* meter, int format, int showAddress, int constant)
+{
+	char serial[16];
+	ProfilePointer ptr;
+	ProfileCursor cursor, progress;
+	const long size = PROFILE_SIZE / sizeof(ProfileRecord);
+
+	if (OK != readSerial(ttyd, meter, serial) || OK != readProfilePointer(ttyd, meter, &ptr))
+		return -1;
+
+	time_t last = profileTime(ptr.time);
+	int lastAddr = (ptr.addrHi << 8) | ptr.addrLo;
+	if (last < 0 || !ptr.period)
+		return 0;
+
+	loadCursor(serial, &cursor);
+	progress = cursor;
+
+	// Records written since the cursor: one per period at most, fewer if the power was off
+	long written = (lastAddr - cursor.addr + PROFILE_SIZE) % PROFILE_SIZE / sizeof(ProfileRecord);
+	long periods = (last - cursor.time) / (ptr.period * 60);
+	int resync = cursor.addr < 0 || last < cursor.time || periods >= size || written > periods;
+
+	if (debugPrint)
+		printf("Power meter #%d (serial %s): %s.\n\r", meter->address, serial,
+			(cursor.addr < 0) ? "no profile cursor, full read" : resync ? "profile reset or wrapped, full read" : "incremental profile read");
+
+	int printed;
+	if (resync)
+	{
+		progress.addr = -1;
+		printed = readProfileRecords(ttyd, meter, (lastAddr + sizeof(ProfileRecord)) % PROFILE_SIZE, size, 0, last,
+			format, showAddress, constant, &progress);
+	}
+	else
+		printed = readProfileRecords(ttyd, meter, (cursor.addr + sizeof(ProfileRecord)) % PROFILE_SIZE, written,
+			cursor.time + 1, last, format, showAddress, constant, &progress);
+
+	// The records fetched before the failure are not read again
+	if (progress.addr >= 0 && (progress.addr != cursor.addr || progress.time != cursor.time))
+		saveCursor(&progress);
+
+	return printed;
+}
+
+// -- Energy counters matrix cells: the periods (the months one by the months) by the tariffs
+// -- Returns the number of cells.
+int counterCells(CounterCell* cells, int tariffs)
+{
+	int n = 0;
+
+	bzero(cells, COUNTER_CELLS * sizeof(CounterCell));
+	for (int period = PP_RESET; period < PERIOD_NUM; period++)
+		for (int month = (PP_MONTH == period) ? 1 : 0; month <= ((PP_MONTH == period) ? 12 : 0); month++)
+			for (int tariff = 0; tariff <= tariffs; tariff++, n++)
+			{
+				cells[n].period = period;
+				cells[n].month = month;
+				cells[n].tariff = tariff;
+			}
+
+	return n;
+}
+
+// -- Year of the last start of the month given (0-11) before the time given
+int monthStartYear(int month, struct tm* t)
+{
+	return t->tm_year - (month > t->tm_mon);
+}
+
+// -- Check the counters matrix cell read before can't have changed since:
+// -- the past months until they come round, last year until the new year, yesterday until midnight.
+int cellImmutable(CounterCell* cell, time_t now)
+{
+	struct tm r, n;
+
+	if (!cell->read)
+		return 0;
+	localtime_r(&cell->read, &r);
+	localtime_r(&now, &n);
+
+	switch(cell->period)
+	{
+		case PP_LAST_YEAR:
+			return r.tm_year == n.tm_year;
+
+		case PP_YESTERDAY:
+			return r.tm_year == n.tm_year && r.tm_yday == n.tm_yday;
+
+		case PP_MONTH:
+		{
+			int month = cell->month - 1;
+			return month != r.tm_mon && month != n.tm_mon && monthStartYear(month, &r) == monthStartYear(month, &n);
+		}
+
+		default:
+			return 0;
+	}
+}
+
+// -- Load the counters matrix cells cached for the meter serial number
+void loadCounters(const char* serial, CounterCell* cells, int n)
+{
+	char line[BSZ], s[BSZ];
+	int period, month, tariff;
+	long long t;
+	PWV w;
+
+	FILE* f = fopen(COUNTER_CACHE, "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f))
+		if (9 == sscanf(line, "%254s %d %d %d %lld %f %f %f %f", s, &period, &month, &tariff, &t, &w.ap, &w.am, &w.rp, &w.rm)
+			&& !strcmp(s, serial))
+			for (int i = 0; i < n; i++)
+				if (cells[i].period == period && cells[i].month == month && cells[i].tariff == tariff)
+				{
+					cells[i].read = t;
+					cells[i].w = w;
+				}
+	fclose(f);
+}
+
+// -- Keep the counters matrix cells read for the meter serial number, the other meters entries are kept as well
+void saveCounters(const char* serial, CounterCell* cells, int n)
+{
+	char line[BSZ], s[BSZ], tmp[BSZ];
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", COUNTER_CACHE, getpid());
+	FILE* out = fopen(tmp, "w");
+	if (!out)
+		return;
+
+	FILE* f = fopen(COUNTER_CACHE, "r");
+	if (f)
+	{
+		while (fgets(line, sizeof(line), f))
+			if (1 == sscanf(line, "%254s", s) && strcmp(s, serial))
+				fputs(line, out);
+		fclose(f);
+	}
+	for (int i = 0; i < n; i++)
+		if (cells[i].read)
+			fprintf(out, "%s %d %d %d %lld %.3f %.3f %.3f %.3f\n", serial, cells[i].period, cells[i].month, cells[i].tariff,
+				(long long)cells[i].read, cells[i].w.ap, cells[i].w.am, cells[i].w.rp, cells[i].w.rm);
+	fclose(out);
+
+	rename(tmp, COUNTER_CACHE);
+}
+
+// -- Read the counters matrix cell from the meter
+// -- Returns the result: CHECK_CHANNEL_TIME_OUT if the meter doesn't answer.
+int readCounterCell(int ttyd, Meter* meter, CounterCell* cell)
+{
+	byte frame[BSZ], buf[BSZ];
+
+	int len = counterCmd(frame, meter->address, cell->period, cell->month, cell->tariff);
+	int r = transact(ttyd, meter, STEP_NUM, frame, len, buf, 1 + sizeof(PWV) + sizeof(UInt16));
+
+	if (OK == r)
+	{
+		cell->w.ap = B4F(buf + 1, 1000.0);
+		cell->w.am = B4F(buf + 5, 1000.0);
+		cell->w.rp = B4F(buf + 9, 1000.0);
+		cell->w.rm = B4F(buf + 13, 1000.0);
+		cell->read = time(NULL);
+	}
+
+	return r;
+}
+
+// -- Print the counters matrix cell
+void printCounterCell(FILE* out, int format, Meter* meter, int showAddress, CounterCell* cell)
+{
+	char timeStamp[BSZ];
+
+	getDateTimeStr(timeStamp, BSZ, cell->read);
+	switch(format)
+	{
+		case OF_HUMAN:
+			if (showAddress)
+				fprintf(out, "#%d ", meter->address);
+			fprintf(out, "%-9s %2d  T%d  A+ %10.3f  A- %10.3f  R+ %10.3f  R- %10.3f  (read %s)\n\r",
+				periodName[cell->period], cell->month, cell->tariff, cell->w.ap, cell->w.am, cell->w.rp, cell->w.rm, timeStamp);
+			break;
+
+		case OF_CSV:
+			if (showAddress)
+				fprintf(out, "%d,", meter->address);
+			fprintf(out, "%s,%d,%d,%.3f,%.3f,%.3f,%.3f,%s\n\r",
+				periodName[cell->period], cell->month, cell->tariff, cell->w.ap, cell->w.am, cell->w.rp, cell->w.rm, timeStamp);
+			break;
+
+		case OF_JSON:
+			fprintf(out, "{");
+			if (showAddress)
+				fprintf(out, "\"Addr\":%d,", meter->address);
+			fprintf(out, "\"Period\":\"%s\",\"Month\":%d,\"Tariff\":%d,\"ap\":%.3f,\"am\":%.3f,\"rp\":%.3f,\"rm\":%.3f,\"Read\":\"%s\"}\n\r",
+				periodName[cell->period], cell->month, cell->tariff, cell->w.ap, cell->w.am, cell->w.rp, cell->w.rm, timeStamp);
+			break;
+	}
+}
+
+// -- Read the whole energy counters matrix and print it, the cells that can't have changed are taken from the cache
+// -- The cache is kept by the meter serial number in COUNTER_CACHE.
+// -- Returns the number of cells read from the meter, -1 if the meter has failed.
+int syncCounters(int ttyd, Meter* meter, int tariffs, int format, int showAddress)
+{
+	char serial[16];
+	CounterCell cells[COUNTER_CELLS];
+	int read = 0, failed = 0;
+
+	if (OK != readSerial(ttyd, meter, serial))
+		return -1;
+
+	int n = counterCells(cells, tariffs);
+	loadCounters(serial, cells, n);
+
+	time_t now = time(NULL);
+	for (int i = 0; i < n; i++)
+	{
+		CounterCell* cell = &cells[i];
+		if (!cellImmutable(cell, now))
+		{
+			if (OK != readCounterCell(ttyd, meter, cell))
+			{
+				failed++;
+				continue;
+			}
+			read++;
+		}
+		printCounterCell(stdout, format, meter, showAddress, cell);
+	}
+	fflush(stdout);
+
+	saveCounters(serial, cells, n);
+
+	if (debugPrint || failed)
+		printf("Power meter #%d (serial %s): %d counters cells read, %d cached, %d failed.\n\r",
+			meter->address, serial, read, n - read - failed, failed);
+
+	return read;
+}
+
+// -- Parse comma-separated list of meter addresses
+// -- Returns number of meters or 0 if the list is invalid.
+int parseAddresses(const char* list, Meter* meters)
+{
+	int n = 0;
+	char* end;
+
+	do
+	{
+		long addr = strtol(list, &end, 10);
+		if (end == list || addr < 0 || addr > 0xFF || n == MAX_METERS)
+			return 0;
+
+		bzero(&meters[n], sizeof(Meter));
+		meters[n++].address = addr;
+		list = end + 1;
+	}
+	while (*end == ',');
+
+	if (*end)
+		return 0;
+
+	// Any meter answers to address 0, it is useless on the shared bus
+	for (int i = 0; i < n; i++)
+		if (n > 1 && meters[i].address == 0)
+			return 0;
+
+	return n;
+}
+
+// -- Parse the periods by parameter groups: comma-separated list of GROUP=PERIOD
+// -- Returns 0 if the list is invalid.
+int parseSchedule(const char* list, int* periods)
+{
+	char* end;
+
+	do
+	{
+		int g = 0;
+		while (g < GROUP_NUM && (strncmp(list, groupName[g], strlen(groupName[g])) || list[strlen(groupName[g])] != '='))
+			g++;
+		if (g == GROUP_NUM)
+			return 0;
+
+		list += strlen(groupName[g]) + 1;
+		long period = strtol(list, &end, 10);
+		if (end == list || period < 0)
+			return 0;
+
+		periods[g] = period;
+		list = end + 1;
+	}
+	while (*end == ',');
+
+	return !*end;
+}
+
+// -- Daemon mode termination request
+void onStopSignal(int sig)
+{
+	stopRequested = 1;
+}
+
+// -- Daemon mode transaction statistics request
+void onStatsSignal(int sig)
+{
+	statsRequested = 1;
+}
+
+// -- Print the transaction statistics if requested by the signal
+void checkStatsRequest()
+{
+	if (statsRequested)
+	{
+		statsRequested = 0;
+		dumpStats();
+	}
+}
+
+// -- Command line usage help
+void printUsage()
+{
+	printf("Usage: mercury236 RS485[:N[,N...]][,RS485...] [OPTIONS] ...\n\r\n\r");
+	printf("  RS485\t\taddress of RS485 dongle (e.g. /dev/ttyUSB0), required\n\r");
+	printf("\t\tcomma-separated list of dongles to poll them concurrently (%s is ignored)\n\r", OPT_FIXED_DELAY);
+	printf("\t\tthe meter addresses on the dongle follow its colon (e.g. /dev/ttyUSB0:1,2,/dev/ttyUSB1:3),\n\r");
+	printf("\t\tthe dongles without them poll the %s ones\n\r", OPT_ADDRESS);
+	printf("  %s\tto print extra debug info\n\r", OPT_DEBUG);
+	printf("  %s\tdry run to see output sample, no hardware required\n\r", OPT_TEST_RUN);
+	printf("  %s\tto wait the fixed inter-command delay instead of the responce (slow dongles)\n\r", OPT_FIXED_DELAY);
+	printf("  %s N|auto\tport baud rate (default %d): 300, 600, 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200\n\r",
+		OPT_BAUD, BAUDRATE_BPS);
+	printf("\t\tauto probes them with the channel test of the meters in turn, the rate found is cached in %s\n\r", BAUD_CACHE);
+	printf("  %s N[,STEP=N...]\n\r", OPT_TIMEOUT);
+	printf("\t\tresponce timeout in ms for all the commands and by poll steps (default %d):\n\r", CH_TIME_OUT * 1000);
+	printf("\t\tCHECK, INIT, AUX, U, I, COSF, F, A, P, S, PR, PRT1, PRT2, PY, PT, CLOSE (e.g. 150,AUX=300)\n\r");
+	printf("  %s N\tconsecutive timeouts cutting the meter off (default %d, 0 - never): the meter is probed\n\r",
+		OPT_BREAKER, DEF_BREAKER);
+	printf("\t\twith the %d ms channel test then, every %d s doubled up to %d s, until it answers\n\r",
+		PROBE_TIME_OUT, PROBE_DELAY, PROBE_DELAY_MAX);
+	printf("  %s N\tretries of the garbled or lost transaction, %d ms backoff doubled every retry (default %d)\n\r",
+		OPT_RETRIES, RETRY_BACKOFF / 1000, DEF_RETRIES);
+	printf("\t\tthe values failed after the retries are marked invalid, the rest are still printed\n\r");
+	printf("\n\r");
+	printf("  Polling:\n\r");
+	printf("  %s N[,N...]\tRS485 addresses of the meters to poll in turn (default %d - any meter)\n\r", OPT_ADDRESS, PM_ADDRESS);
+	printf("  %s\tkeep the session open and poll the meter continuously\n\r", OPT_DAEMON);
+	printf("  %s N\tpolling interval in seconds (with %s only, default %d)\n\r", OPT_INTERVAL, OPT_DAEMON, DEF_INTERVAL);
+	printf("  %s G=N[,G=N...]\n\r", OPT_SCHEDULE);
+	printf("\t\tpolling period in seconds by parameter group, every interval by default (with %s only)\n\r", OPT_DAEMON);
+	printf("\t\tgroups: U, I, C - cos(f), F, A - angles, P, S, W - counters; the data age is printed\n\r");
+	printf("  %s PATH\tserve the data over the Unix socket PATH, the port is opened by the broker only\n\r", OPT_BROKER);
+	printf("\t\trequest line: [PORT] ADDR [GROUPS] (e.g. \"0 UIP\", all groups by default), reply: the output of the meter\n\r");
+	printf("\t\tthe port is required if the address is on several dongles (e.g. \"/dev/ttyUSB1 1 U\")\n\r");
+	printf("\t\tor ERR with the reason; concurrent requests for the same meter share one poll\n\r");
+	printf("\t\tSTATS request line replies with the cache hits, misses and refreshes by groups\n\r");
+	printf("\t\tand the transaction statistics by meters\n\r");
+	printf("  %s G=N[,G=N...]\n\r", OPT_TTL);
+	printf("\t\tbroker cache TTL in seconds by parameter group, not cached by default (with %s only)\n\r", OPT_BROKER);
+	printf("\t\tthe stale data is replied at once and refreshed in the background\n\r");
+	printf("\n\r");
+	printf("  Load profile:\n\r");
+	printf("  %s FROM TO\n\r", OPT_PROFILE);
+	printf("\t\tdownload the average powers archive records of the time range given (YYYY-MM-DD[THH:MM])\n\r");
+	printf("\t\tinstead of the current values, the records are printed as they are read\n\r");
+	printf("  %s\t\tdownload the archive records newer than the ones fetched by the previous %s run,\n\r", OPT_SYNC, OPT_SYNC);
+	printf("\t\tthe last records fetched are kept by the meter serial numbers in %s\n\r", PROFILE_CURSORS);
+	printf("  %s all\tread the whole energy counters matrix instead of the current values: from reset, this year,\n\r", OPT_COUNTERS);
+	printf("\t\tlast year, by months, today, yesterday; all tariffs and by tariffs; A+, A-, R+, R- (kWh, kvarh)\n\r");
+	printf("\t\tthe cells that can't have changed (past months, last year, yesterday) are cached by the meter\n\r");
+	printf("\t\tserial numbers in %s and aren't read again\n\r", COUNTER_CACHE);
+	printf("  %s N\tnumber of tariffs of the counters matrix (default %d)\n\r", OPT_TARIFFS, MAX_TARIFFS);
+	printf("  %s N\tmeter constant in imp/kWh to convert the profile values (default %d)\n\r", OPT_CONSTANT, DEF_CONSTANT);
+	printf("\n\r");
+	printf("  Output formatting:\n\r");
+	printf("  %s\thuman readable (default)\n\r", OPT_HUMAN);
+	printf("  %s\t\tCSV\n\r", OPT_CSV);
+	printf("  %s\tjson\n\r", OPT_JSON);
+	printf("  %s\tto print data header (with %s only)\n\r", OPT_HEADER, OPT_CSV);
+	printf("  %s LIST\tto print and read just the values listed: NAME.SUB or NAME for all its values,\n\r", OPT_FIELDS);
+	printf("\t\tthe names of %s output (e.g. P.sum,U,PT.ap)\n\r", OPT_JSON);
+	printf("  Valid value of the CSV and json output is the bit mask of the values read successfully,\n\r");
+	printf("  from bit 0: U, I, COSF, F, A, P, S, PR, PRT1, PRT2, PY, PT (all valid: %d)\n\r", FIELDS_ALL);
+	printf("\n\r");
+	printf("  Zabbix sender:\n\r");
+	printf("  %s HOST[:PORT]\n\r", OPT_ZABBIX);
+	printf("\t\tsend the samples to the Zabbix trapper (default port %s) instead of printing them\n\r", ZABBIX_PORT);
+	printf("\t\titem keys are the agent module ones: mercury236.voltage[p1], mercury236.counter[today,ap] etc.\n\r");
+	printf("\t\twith the meter address as the last key parameter when %s is given\n\r", OPT_ADDRESS);
+	printf("  %s NAME\tmonitored host name in Zabbix (default the hostname)\n\r", OPT_ZABBIX_HOST);
+	printf("  %s N\tmeter samples sent in one packet (default 1)\n\r", OPT_FLUSH_SIZE);
+	printf("  %s N\tmax seconds the samples are kept in the batch (default 0 - by size only)\n\r", OPT_FLUSH_INT);
+	printf("\n\r");
+	printf("  Statistics:\n\r");
+	printf("  %s\tto print the transactions timing (request write, meter turnaround, responce receive),\n\r", OPT_STATS);
+	printf("\t\toutcome counters and time histogram by meters to stderr as JSON lines on exit,\n\r");
+	printf("\t\tin daemon mode on SIGUSR1 as well; the broker STATS request replies with them too\n\r");
+	printf("\t\tthe timing and histogram are of the transactions answered, the timeouts are just counted\n\r");
+	printf("\n\r");
+	printf("  %s\tprints this screen\n\r", OPT_HELP);
+}
+
+// -- Print the values selected to out, the values not read are printed as - (null, empty)
+void printSelected(FILE* out, int format, Meter* meter, int header, int showAddress, const char* port)
+{
+	char timeStamp[BSZ];
+	getDateTimeStr(timeStamp, BSZ, time(NULL));
+
+	switch(format)
+	{
+		case OF_HUMAN:
+			if (port)
+				fprintf(out, "%s:\n\r", port);
+			if (showAddress)
+				fprintf(out, "Power meter #%d:\n\r", meter->address);
+			for (int i = 0; i < selectedNum; i++)
+			{
+				const OutputField* f = &outputFields[selectedFields[i]];
+				if (fieldValid(meter, f->field))
+					fprintf(out, "  %-16s%12.2f\n\r", f->name, *(float*)((byte*)&meter->o + f->field));
+				else
+					fprintf(out, "  %-16s%12s\n\r", f->name, "-");
+			}
+			break;
+
+		case OF_CSV:
+			if (header)
+			{
+				fprintf(out, "DT%s%s", port ? ",Port" : "", showAddress ? ",Addr" : "");
+				for (int i = 0; i < selectedNum; i++)
+					fprintf(out, ",%s", outputFields[selectedFields[i]].name);
+				fprintf(out, "\n\r");
+			}
+			fprintf(out, "%s", timeStamp);
+			if (port)
+				fprintf(out, ",%s", port);
+			if (showAddress)
+				fprintf(out, ",%d", meter->address);
+			for (int i = 0; i < selectedNum; i++)
+			{
+				const OutputField* f = &outputFields[selectedFields[i]];
+				if (fieldValid(meter, f->field))
+					fprintf(out, ",%.2f", *(float*)((byte*)&meter->o + f->field));
+				else
+					fprintf(out, ",");
+			}
+			fprintf(out, "\n\r");
+			break;
+
+		case OF_JSON:
+			fprintf(out, "{\"DT\":\"%s\"", timeStamp);
+			if (port)
+				fprintf(out, ",\"Port\":\"%s\"", port);
+			if (showAddress)
+				fprintf(out, ",\"Addr\":%d", meter->address);
+			for (int i = 0; i < selectedNum; i++)
+			{
+				const OutputField* f = &outputFields[selectedFields[i]];
+				if (fieldValid(meter, f->field))
+					fprintf(out, ",\"%s\":%.2f", f->name, *(float*)((byte*)&meter->o + f->field));
+				else
+					fprintf(out, ",\"%s\":null", f->name);
+			}
+			fprintf(out, "}\n\r");
+			break;
+	}
+}
+
+// -- Output formatting and print to out
+// -- The meter address is printed along with the data if showAddress is set
+// -- port is the RS485 dongle printed along with the data, none if NULL
+// -- The age of the parameter groups (sec, -1 if never read) is printed when the polling is scheduled
+void printOutput(FILE* out, int format, Meter* meter, int header, int showAddress, const char* port)
+{
+	if (selectedNum)
+	{
+		printSelected(out, format, meter, header, showAddress, port);
+		return;
+	}
+
+	OutputBlock o = meter->o;
+	int addr = showAddress ? meter->address : -1;
+	time_t now = time(NULL);
+	int age[GROUP_NUM];
+
+	for (int g = 0; g < GROUP_NUM; g++)
+		age[g] = meter->updated[g] ? now - meter->updated[g] : -1;
+
+	// getting current time for timestamp
+	char timeStamp[BSZ];
+	getDateTimeStr(timeStamp, BSZ, now);
+
+	switch(format)
+	{
+		case OF_HUMAN:
+			if (port)
+				fprintf(out, "%s:\n\r", port);
+			if (addr >= 0)
+				fprintf(out, "Power meter #%d:\n\r", addr);
+			fprintf(out, "  Voltage (V):             		%8.2f %8.2f %8.2f\n\r", o.U.p1, o.U.p2, o.U.p3);
+			fprintf(out, "  Current (A):             		%8.2f %8.2f %8.2f\n\r", o.I.p1, o.I.p2, o.I.p3);
+			fprintf(out, "  Cos(f):                  		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.C.p1, o.C.p2, o.C.p3, o.C.sum);
+			fprintf(out, "  Frequency (Hz):          		%8.2f\n\r", o.f);
+			fprintf(out, "  Phase angles (deg):      		%8.2f %8.2f %8.2f\n\r", o.A.p1, o.A.p2, o.A.p3);
+			fprintf(out, "  Active power (W):        		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.P.p1, o.P.p2, o.P.p3, o.P.sum);
+			fprintf(out, "  Reactive power (VA):     		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.S.p1, o.S.p2, o.S.p3, o.S.sum);
+			fprintf(out, "  Total consumed, all tariffs (KW):	%8.2f\n\r", o.PR.ap);
+			fprintf(out, "    including day tariff (KW):		%8.2f\n\r", o.PRT[0].ap);
+			fprintf(out, "    including night tariff (KW):	%8.2f\n\r", o.PRT[1].ap);
+			fprintf(out, "  Yesterday consumed (KW): 		%8.2f\n\r", o.PY.ap);
+			fprintf(out, "  Today consumed (KW):     		%8.2f\n\r", o.PT.ap);
+			if (meter->valid != FIELDS_ALL)
+			{
+				fprintf(out, "  Not read (invalid):      		");
+				for (int step = STEP_U; step < STEP_CLOSE; step++)
+					if (!(meter->valid & FIELD_BIT(step)))
+						fprintf(out, "%s ", stepName[step]);
+				fprintf(out, "\n\r");
+			}
+			if (scheduled)
+			{
+				fprintf(out, "  Data age (s):            		");
+				for (int g = 0; g < GROUP_NUM; g++)
+					fprintf(out, "%s %d ", groupName[g], age[g]);
+				fprintf(out, "\n\r");
+			}
+			break;
+
+		case OF_CSV:
+			if (header)
+			{
+				// to be the same order as params below
+				fprintf(out, "DT,%s%sU1,U2,U3,I1,I2,I3,P1,P2,P3,Psum,S1,S2,S3,Ssum,C1,C2,C3,Csum,F,A1,A2,A3,PRa,PRDa,PRNa,PYa,PTa,Valid",
+					port ? "Port," : "", (addr >= 0) ? "Addr," : "");
+				if (scheduled)
+					for (int g = 0; g < GROUP_NUM; g++)
+						fprintf(out, ",Age%s", groupName[g]);
+				fprintf(out, "\n\r");
+
+			}
+			fprintf(out, "%s,", timeStamp);
+			if (port)
+				fprintf(out, "%s,", port);
+			if (addr >= 0)
+				fprintf(out, "%d,", addr);
+			fprintf(out, "%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%d",
+				o.U.p1, o.U.p2, o.U.p3,
+				o.I.p1, o.I.p2, o.I.p3,
+				o.P.p1, o.P.p2, o.P.p3, o.P.sum,
+				o.S.p1, o.S.p2, o.S.p3, o.S.sum,
+				o.C.p1, o.C.p2, o.C.p3, o.C.sum,
+				o.f,
+				o.A.p1, o.A.p2, o.A.p3,
+				o.PR.ap, o.PRT[0].ap, o.PRT[1].ap,
+				o.PY.ap,
+				o.PT.ap,
+				meter->valid
+			);
+			if (scheduled)
+				for (int g = 0; g < GROUP_NUM; g++)
+					fprintf(out, ",%d", age[g]);
+			fprintf(out, "\n\r");
+			break;
+
+		case OF_JSON:
+			fprintf(out, "{");
+			if (port)
+				fprintf(out, "\"Port\":\"%s\",", port);
+			if (addr >= 0)
+				fprintf(out, "\"Addr\":%d,", addr);
+			fprintf(out, "\"U\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f},\"I\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f},\"CosF\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f},\"F\":%.2f,\"A\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f},\"P\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f},\"S\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f},\"PR\":{\"ap\":%.2f},\"PR-day\":{\"ap\":%.2f},\"PR-night\":{\"ap\":%.2f},\"PY\":{\"ap\":%.2f},\"PT\":{\"ap\":%.2f},\"Valid\":%d",
+				o.U.p1, o.U.p2, o.U.p3,
+				o.I.p1, o.I.p2, o.I.p3,
+				o.C.p1, o.C.p2, o.C.p3, o.C.sum,
+				o.f,
+				o.A.p1, o.A.p2, o.A.p3,
+				o.P.p1, o.P.p2, o.P.p3, o.P.sum,
+				o.S.p1, o.S.p2, o.S.p3, o.S.sum,
+				o.PR.ap, o.PRT[0].ap, o.PRT[1].ap,
+				o.PY.ap,
+				o.PT.ap,
+				meter->valid
+			);
+			if (scheduled)
+			{
+				fprintf(out, ",\"Age\":{");
+				for (int g = 0; g < GROUP_NUM; g++)
+					fprintf(out, "%s\"%s\":%d", g ? "," : "", groupName[g], age[g]);
+				fprintf(out, "}");
+			}
+			fprintf(out, "}\n\r");
+			break;
+
+		default:
+			exitFailure("Invalid formatting.");
+			break;
+	}
+}
+
+// Output block values by the Zabbix item keys (the agent module keys)
+typedef struct
+{
+	const char*	key;
+	const char*	params;		// key parameters before the meter address
+	int		group;		// parameter group of the value
+	size_t		field;
+} OutputValue;
+
+const OutputValue outputValues[] =
+{
+	{ "voltage", "p1", G_U, OB(U.p1) }, { "voltage", "p2", G_U, OB(U.p2) }, { "voltage", "p3", G_U, OB(U.p3) },
+	{ "current", "p1", G_I, OB(I.p1) }, { "current", "p2", G_I, OB(I.p2) }, { "current", "p3", G_I, OB(I.p3) },
+	{ "cosf", "sum", G_C, OB(C.sum) }, { "cosf", "p1", G_C, OB(C.p1) }, { "cosf", "p2", G_C, OB(C.p2) }, { "cosf", "p3", G_C, OB(C.p3) },
+	{ "frequency", "", G_F, OB(f) },
+	{ "angle", "p1", G_A, OB(A.p1) }, { "angle", "p2", G_A, OB(A.p2) }, { "angle", "p3", G_A, OB(A.p3) },
+	{ "power", "sum", G_P, OB(P.sum) }, { "power", "p1", G_P, OB(P.p1) }, { "power", "p2", G_P, OB(P.p2) }, { "power", "p3", G_P, OB(P.p3) },
+	{ "reactive", "sum", G_S, OB(S.sum) }, { "reactive", "p1", G_S, OB(S.p1) }, { "reactive", "p2", G_S, OB(S.p2) }, { "reactive", "p3", G_S, OB(S.p3) },
+	{ "counter", "reset,ap", G_W, OB(PR.ap) },
+	{ "counter", "day,ap", G_W, OB(PRT[0].ap) },
+	{ "counter", "night,ap", G_W, OB(PRT[1].ap) },
+	{ "counter", "yesterday,ap", G_W, OB(PY.ap) },
+	{ "counter", "today,ap", G_W, OB(PT.ap) },
+	{ NULL }
+};
+
+// Zabbix sender sink: the samples are batched and sent to the trapper in one packet
+const char* zabbixServer = NULL;	// trapper host, NULL if the output goes to stdout
+const char* zabbixPort = ZABBIX_PORT;
+char zabbixHost[BSZ];			// monitored host name
+int zabbixFlushSize = 1;		// samples per packet
+int zabbixFlushInterval = 0;		// max time the samples are kept (sec), 0 - flushed by size only
+FILE* zabbixBatch = NULL;		// JSON data of the samples queued
+char* zabbixData;
+size_t zabbixLen;
+int zabbixSamples = 0;
+int zabbixValues = 0;
+time_t zabbixQueued;			// the first sample queued time
+
+// -- Send the Zabbix protocol packet to the trapper and read the responce
+// -- Returns 0 if the trapper hasn't accepted the data.
+int zabbixSend(const char* data, size_t len, char* resp, int respSize)
+{
+	struct addrinfo hints, *ai;
+	struct timeval timeout = { ZABBIX_TIME_OUT, 0 };
+	byte header[13] = { 'Z', 'B', 'X', 'D', 0x01 };
+
+	// Data length: 64-bit little endian
+	for (int i = 0; i < 8; i++)
+		header[5 + i] = ((uint64_t)len >> (8 * i)) & 0xFF;
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(zabbixServer, zabbixPort, &hints, &ai))
+		return 0;
+
+	int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	int ok = fd >= 0
+		&& !setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))
+		&& !setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))
+		&& !connect(fd, ai->ai_addr, ai->ai_addrlen)
+		&& send(fd, header, sizeof(header), MSG_NOSIGNAL) == sizeof(header)
+		&& send(fd, data, len, MSG_NOSIGNAL) == len;
+	freeaddrinfo(ai);
+
+	// Responce: the same header and the JSON with the processing info
+	int n = 0, r = 0;
+	while (ok && n < respSize - 1 && (r = recv(fd, resp + n, respSize - 1 - n, 0)) > 0)
+		n += r;
+	resp[n] = 0;
+	if (fd >= 0)
+		close(fd);
+
+	if (debugPrint)
+		printf("Zabbix trapper responce: %s\n\r", (n > (int)sizeof(header)) ? resp + sizeof(header) : "none");
+
+	return ok && n > sizeof(header) && !memcmp(resp, header, 5) && strstr(resp + sizeof(header), "\"success\"");
+}
+
+// -- Send the samples queued to the Zabbix trapper
+void zabbixFlush()
+{
+	char resp[BSZ * 4];
+
+	if (!zabbixBatch)
+		return;
+
+	fprintf(zabbixBatch, "],\"clock\":%ld}", (long)time(NULL));
+	fclose(zabbixBatch);
+	zabbixBatch = NULL;
+
+	if (!zabbixSend(zabbixData, zabbixLen, resp, sizeof(resp)))
+		fprintf(stderr, "Zabbix trapper %s has not accepted %d values.\n", zabbixServer, zabbixValues);
+
+	free(zabbixData);
+	zabbixSamples = zabbixValues = 0;
+}
+
+// -- Send the samples queued if kept for the flush interval, checked on every sample and poll tick
+void zabbixFlushDue()
+{
+	if (zabbixBatch && zabbixFlushInterval && time(NULL) - zabbixQueued >= zabbixFlushInterval)
+		zabbixFlush();
+}
+
+// -- Print the JSON string literal: the quotes, backslashes and control characters are escaped
+void printJsonString(FILE* out, const char* str)
+{
+	fputc('"', out);
+	for (; *str; str++)
+	{
+		if ('"' == *str || '\\' == *str)
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+// -- Queue all the values of the meter sample for the Zabbix trapper, the batch is sent when full or expired
+// -- The meter address is the last key parameter if showAddress is set.
+void zabbixQueue(Meter* meter, int showAddress)
+{
+	char addr[8] = "";
+	int queued = 0;
+
+	if (showAddress)
+		snprintf(addr, sizeof(addr), "%d", meter->address);
+
+	// Just the valid values read within the cycle are sent, none if the meter doesn't answer
+	// The groups never read are skipped too: they have no read time to send (0 in one-shot mode).
+	for (const OutputValue* v = outputValues; v->key; v++)
+	{
+		if (!meter->updated[v->group] || meter->updated[v->group] != meter->cycleStarted || !fieldValid(meter, v->field))
+			continue;
+
+		if (!zabbixBatch)
+		{
+			zabbixBatch = open_memstream(&zabbixData, &zabbixLen);
+			fprintf(zabbixBatch, "{\"request\":\"sender data\",\"data\":[");
+			zabbixQueued = time(NULL);
+		}
+
+		const char* sep = (*v->params && *addr) ? "," : "";
+		int brackets = *v->params || *addr;
+
+		char key[BSZ];
+		snprintf(key, sizeof(key), "mercury236.%s%s%s%s%s%s",
+			v->key, brackets ? "[" : "", v->params, sep, addr, brackets ? "]" : "");
+
+		// The host name is given by the user, so both strings are escaped
+		queued++;
+		fprintf(zabbixBatch, "%s{\"host\":", zabbixValues++ ? "," : "");
+		printJsonString(zabbixBatch, zabbixHost);
+		fprintf(zabbixBatch, ",\"key\":");
+		printJsonString(zabbixBatch, key);
+		fprintf(zabbixBatch, ",\"value\":\"%.2f\",\"clock\":%ld}",
+			*(float*)((byte*)&meter->o + v->field), (long)meter->cycleStarted);
+	}
+
+	if (queued && ++zabbixSamples >= zabbixFlushSize)
+		zabbixFlush();
+	else
+		zabbixFlushDue();
+}
+
+// -- Meter sample output: printed or queued for the Zabbix trapper
+void outputMeter(int format, Meter* meter, int header, int showAddress, const char* port)
+{
+	if (zabbixServer)
+		zabbixQueue(meter, showAddress);
+	else
+		printOutput(stdout, format, meter, header, showAddress, port);
+}
+
+// -- Parse the Zabbix trapper address: HOST[:PORT]
+void parseZabbixServer(char* server)
+{
+	char* port = strrchr(server, ':');
+	if (port)
+	{
+		*port = 0;
+		zabbixPort = port + 1;
+	}
+	zabbixServer = server;
+}
+
+// **** Embedding API: non-blocking poll of the meter driven by the caller event loop (see mercury236.h)
+
+// -- Default debug messages receiver of the API: the messages are dropped
+void mercuryNoLog(int address, const char* msg)
+{
+}
+
+// -- Set up the poll context of the meter on the port given
+void mercury_init(MercuryCtx* ctx, int fd, byte address, int baud)
+{
+	bzero(ctx, sizeof(MercuryCtx));
+	ctx->fd = fd;
+	ctx->baud = baud;
+	ctx->meter.address = address;
+	ctx->meter.baud = baud;
+	ctx->meter.fields = FIELDS_ALL;
+	ctx->meter.log = mercuryNoLog;
+}
+
+// -- Start the poll of the meter: the session is opened if needed and the values due are read
+// -- Returns 0 if the meter is cut off by the breaker and its probe isn't due yet.
+int mercury_start(MercuryCtx* ctx)
+{
+	Meter* meter = &ctx->meter;
+
+	meter->failure = NULL;
+	startCycle(meter, time(NULL));
+	if (!meter->online && !probeDue(meter, meter->cycleStarted))
+	{
+		meter->failure = "Power meter doesn't answer, it is probed at the growing intervals.";
+		return 0;
+	}
+
+	ctx->step = meter->online ? firstDataStep(meter) : STEP_CHECK;
+	ctx->reconnected = 0;
+	ctx->retry = 0;
+	ctx->written = 0;
+	ctx->state = (STEP_CLOSE == ctx->step && ctx->keepSession) ? MS_IDLE : MS_SEND;
+
+	return 1;
+}
+
+// -- The poll has failed: the session is considered lost
+void mercuryFailure(MercuryCtx* ctx, const char* msg)
+{
+	Meter* meter = &ctx->meter;
+
+	meter->valid = 0;
+	meter->online = 0;
+	meter->failure = msg;
+	ctx->state = MS_IDLE;
+}
+
+// -- Go on with the poll after the transaction result
+void mercuryResult(MercuryCtx* ctx, int result, double now)
+{
+	// Garbled and lost frames are retried after the growing backoff
+	if (ctx->retry < txRetries && retryable(ctx->step, result))
+	{
+		ctx->deadline = now + (RETRY_BACKOFF << ctx->retry++) / 1000.0;
+		ctx->state = MS_BACKOFF;
+		return;
+	}
+	ctx->retry = 0;
+	meterHealth(&ctx->meter, CHECK_CHANNEL_TIME_OUT != result);
+
+	if (CHECK_CHANNEL_TIME_OUT == result)
+	{
+		if (STEP_CHECK == ctx->step)
+		{
+			ctx->meter.valid = 0;
+			ctx->meter.online = 0;
+			ctx->meter.failure = "Power meter doesn't answer.";
+			ctx->state = MS_IDLE;
+		}
+		else
+			mercuryFailure(ctx, "Communication channel timeout.");
+		return;
+	}
+
+	int next = pollNext(&ctx->meter, ctx->step, result, ctx->keepSession, &ctx->reconnected);
+	if (next < 0)
+		mercuryFailure(ctx, stepDesc[ctx->step].failure);
+	else if (STEP_NUM == next)
+		ctx->state = MS_IDLE;
+	else
+	{
+		ctx->step = next;
+		ctx->state = MS_SEND;
+	}
+}
+
+// -- The responce frame is complete or the line is silent
+void mercuryReply(MercuryCtx* ctx, double now)
+{
+	Meter* meter = &ctx->meter;
+
+	int len = frameEnd(&ctx->resp);
+	if (ctx->resp.dropped)
+		meterDebug(meter, "Dropped bytes: %d", ctx->resp.dropped);
+	int result = stepDecode(ctx->step, ctx->buf, len, &meter->o);
+	txRecord(&meter->stats, &ctx->resp, result);
+
+	mercuryResult(ctx, result, now);
+}
+
+// -- Drive the poll with the port events ready (MercuryInterest bit mask) at the time given (CLOCK_MONOTONIC ms)
+// -- Returns the port events and the time to wait for, MERCURY_IDLE interest when the poll is over.
+MercuryWait mercury_step(MercuryCtx* ctx, int events, double now)
+{
+	Meter* meter = &ctx->meter;
+	int len, r = 0;
+
+	for (;;)
+	{
+		switch(ctx->state)
+		{
+			case MS_IDLE:
+				return (MercuryWait){ MERCURY_IDLE, 0 };
+
+			case MS_SEND:
+			{
+				byte* frame = stepFrame(meter, ctx->step, &len);
+				if (!ctx->written)
+				{
+					frameStart(&ctx->resp, ctx->buf, stepRespLen(&stepDesc[ctx->step]));
+					ctx->resp.started = now;
+				}
+
+				r = write(ctx->fd, frame + ctx->written, len - ctx->written);
+				if (r < 0 && EAGAIN != errno)
+				{
+					mercuryFailure(ctx, "Write failed.");
+					continue;
+				}
+				if (r > 0)
+					ctx->written += r;
+				if (ctx->written < len)
+					return (MercuryWait){ MERCURY_WRITE, 0 };
+
+				ctx->written = 0;
+				ctx->resp.sent = now;
+				ctx->deadline = now + responceTimeout(meter, ctx->step) / 1000.0;
+				ctx->state = MS_WAIT;
+				events = 0;
+				break;
+			}
+
+			case MS_WAIT:
+				if (events & MERCURY_READ)
+				{
+					int done = 0;
+					while (!done && (r = read(ctx->fd, ctx->buf + ctx->resp.len, frameMissing(&ctx->resp))) > 0)
+					{
+						if (!ctx->resp.first)
+							ctx->resp.first = now;
+						done = frameReceived(&ctx->resp, r);
+					}
+
+					if (done)
+					{
+						mercuryReply(ctx, now);
+						events = 0;
+						continue;
+					}
+
+					// The port readable with no data is hung up: it would be reported ready forever
+					if (!r)
+					{
+						mercuryFailure(ctx, "Port closed.");
+						continue;
+					}
+					if (r < 0 && EAGAIN != errno)
+					{
+						mercuryFailure(ctx, "Read failed.");
+						continue;
+					}
+
+					// Wait for the rest of the frame
+					if (ctx->resp.len)
+						ctx->deadline = now + FRAME_GAP(ctx->baud) / 1000.0;
+					events = 0;
+				}
+
+				if (now < ctx->deadline)
+					return (MercuryWait){ MERCURY_READ, ctx->deadline };
+
+				if (ctx->resp.len > 0)
+					mercuryReply(ctx, now);
+				else
+				{
+					txRecord(&meter->stats, &ctx->resp, CHECK_CHANNEL_TIME_OUT);
+					mercuryResult(ctx, CHECK_CHANNEL_TIME_OUT, now);
+				}
+				break;
+
+			case MS_BACKOFF:
+				// The late bytes of the failed responce are dropped
+				if (events & MERCURY_READ)
+				{
+					while ((r = read(ctx->fd, ctx->buf, BSZ)) > 0);
+					if (!r)
+					{
+						mercuryFailure(ctx, "Port closed.");
+						continue;
+					}
+				}
+				events = 0;
+
+				if (now < ctx->deadline)
+					return (MercuryWait){ MERCURY_READ, ctx->deadline };
+				ctx->state = MS_SEND;
+				break;
+		}
+	}
+}
+
+// -- Arm the timer to expire in mks, 0 disarms it
+void armTimer(int timer, long mks)
+{
+	struct itimerspec t;
+	bzero(&t, sizeof(t));
+	t.it_value.tv_sec = mks / 1000000;
+	t.it_value.tv_nsec = (mks % 1000000) * 1000;
+	timerfd_settime(timer, 0, &t, NULL);
+}
+
+// -- Check the string of the length given is a number
+int isNumber(const char* str, size_t len)
+{
+	return len && strspn(str, "0123456789") >= len;
+}
+
+// -- Split comma-separated list of RS485 dongles with their meter addresses (DEV[:ADDR[,ADDR...]]) in place
+// -- The numbers following the dongle with the addresses are its addresses, addrs gets the address list
+// -- of the dongle or NULL if none (the --address ones are polled there).
+// -- Returns number of ports or 0 if the list is invalid.
+int parsePorts(char* list, char** ports, char** addrs)
+{
+	int n = 0;
+
+	for (char* p = list; ; )
+	{
+		char* end = strchr(p, ',');
+		size_t len = end ? (size_t)(end - p) : strlen(p);
+		if (!len || n == MAX_PORTS)
+			return 0;
+		char* colon = p + len;
+		while (colon > p && ':' != *colon)
+			colon--;
+
+		ports[n] = p;
+		addrs[n] = NULL;
+		if (':' == *colon && isNumber(colon + 1, p + len - colon - 1))
+		{
+			*colon = 0;
+			addrs[n] = colon + 1;
+			while (end && isNumber(end + 1, strcspn(end + 1, ",")))
+				end = strchr(end + 1, ',');
+		}
+		n++;
+
+		if (!end)
+			break;
+		*end = 0;
+		p = end + 1;
+	}
+
+	return n;
+}
+
+void busStartCycle(Reactor* R, Bus* bus);
+void busNextMeter(Reactor* R, Bus* bus);
+void busFailure(Reactor* R, Bus* bus, const char* msg);
+void brokerReply(Reactor* R, Meter* meter);
+int busPending(Bus* bus);
+
+// -- Start the transaction of the current poll step on the bus
+void busSend(Reactor* R, Bus* bus)
+{
+	int len;
+
+	bus->backoff = 0;
+
+	byte* frame = stepFrame(&bus->meters[bus->meter], bus->step, &len);
+	printPackage(frame, len, OUT);
+
+	// The request is left to the driver, its transmission is accounted in the turnaround time
+	frameStart(&bus->resp, bus->buf, stepRespLen(&stepDesc[bus->step]));
+	bus->resp.started = nowMs();
+	if (write(bus->fd, frame, len) != len)
+	{
+		busFailure(R, bus, "Write failed.");
+		return;
+	}
+	bus->resp.sent = nowMs();
+
+	armTimer(bus->timer, responceTimeout(&bus->meters[bus->meter], bus->step));
+}
+
+// -- Start polling the current meter of the bus, ends the bus cycle after the last one
+void busStartMeter(Reactor* R, Bus* bus)
+{
+	if (bus->meter == bus->meterNum)
+	{
+		bus->busy = 0;
+
+		// Requests came in while the cycle was running
+		if (R->broker && busPending(bus))
+			busStartCycle(R, bus);
+		return;
+	}
+
+	Meter* meter = &bus->meters[bus->meter];
+
+	bus->reconnected = 0;
+	meter->failure = NULL;
+	startCycle(meter, time(NULL));
+
+	// The broker polls just the groups requested by the clients
+	if (R->broker)
+	{
+		meter->due = meter->pending;
+		meter->pending = 0;
+		planCycle(meter);
+		if (!meter->due)
+		{
+			bus->meter++;
+			busStartMeter(R, bus);
+			return;
+		}
+	}
+
+	// The meter cut off by the breaker is skipped until its probe is due
+	if (!meter->online && !probeDue(meter, meter->cycleStarted))
+	{
+		meter->failure = "Power meter doesn't answer, it is probed at the growing intervals.";
+		busNextMeter(R, bus);
+		return;
+	}
+
+	if (!meter->online)
+		bus->step = STEP_CHECK;
+	else if (STEP_CLOSE == (bus->step = firstDataStep(meter)))
+	{
+		// Nothing is due for the meter within the cycle
+		busNextMeter(R, bus);
+		return;
+	}
+
+	busSend(R, bus);
+}
+
+// -- Start the poll cycle of the bus
+void busStartCycle(Reactor* R, Bus* bus)
+{
+	bus->busy = 1;
+	bus->meter = 0;
+	busStartMeter(R, bus);
+}
+
+// -- The current meter is done, go on with the next one
+void busNextMeter(Reactor* R, Bus* bus)
+{
+	Meter* meter = &bus->meters[bus->meter];
+
+	if (R->broker)
+		brokerReply(R, meter);
+	else if (R->daemonMode && meter->online)
+	{
+		outputMeter(R->format, meter, R->header, R->showAddress, bus->dev);
+		fflush(stdout);
+		R->header = 0;
+	}
+
+	bus->meter++;
+	busStartMeter(R, bus);
+}
+
+// -- The current meter has failed, the bus goes on with the next one
+void busFailure(Reactor* R, Bus* bus, const char* msg)
+{
+	Meter* meter = &bus->meters[bus->meter];
+
+	fprintf(stderr, "%s: power meter #%d: %s\n", bus->dev, meter->address, msg);
+	bzero(&meter->o, sizeof(OutputBlock));
+	bzero(meter->updated, sizeof(meter->updated));
+	meter->valid = 0;
+	meter->online = 0;
+	meter->failure = msg;
+
+	bus->retry = 0;
+	armTimer(bus->timer, 0);
+	busNextMeter(R, bus);
+}
+
+// -- Handle the result of the poll step transaction
+void busResult(Reactor* R, Bus* bus, int result)
+{
+	// Sessions are kept open in daemon mode
+	int next = pollNext(&bus->meters[bus->meter], bus->step, result, R->daemonMode, &bus->reconnected);
+
+	if (next < 0)
+		busFailure(R, bus, stepDesc[bus->step].failure);
+	else if (STEP_NUM == next)
+		busNextMeter(R, bus);
+	else
+	{
+		bus->step = next;
+		busSend(R, bus);
+	}
+}
+
+// -- Retry the failed transaction after the backoff
+// -- Returns 0 if the transaction isn't to be retried, it is accounted in the meter health then.
+int busRetry(Bus* bus, int result)
+{
+	if (bus->retry == txRetries || !retryable(bus->step, result))
+	{
+		bus->retry = 0;
+		meterHealth(&bus->meters[bus->meter], CHECK_CHANNEL_TIME_OUT != result);
+		return 0;
+	}
+
+	if (debugPrint)
+		printf("Retrying the transaction...\n\r");
+
+	bus->backoff = 1;
+	armTimer(bus->timer, RETRY_BACKOFF << bus->retry++);
+	return 1;
+}
+
+// -- Responce frame is complete or the line is silent
+void busReply(Reactor* R, Bus* bus)
+{
+	armTimer(bus->timer, 0);
+
+	int len = frameEnd(&bus->resp);
+	printPackage(bus->buf, len, IN);
+
+	Meter* meter = &bus->meters[bus->meter];
+	if (bus->resp.dropped)
+		meterDebug(meter, "Dropped bytes: %d", bus->resp.dropped);
+	int result = stepDecode(bus->step, bus->buf, len, &meter->o);
+	txRecord(&meter->stats, &bus->resp, result);
+
+	if (!busRetry(bus, result))
+		busResult(R, bus, result);
+}
+
+// -- Bus input is ready
+void busReadable(Reactor* R, Bus* bus)
+{
+	int r;
+
+	// Nothing is expected between the cycles, the late bytes of the failed responce are dropped
+	if (!bus->busy || bus->backoff)
+	{
+		while (read(bus->fd, bus->buf, BSZ) > 0);
+		return;
+	}
+
+	if (!bus->resp.first)
+		bus->resp.first = nowMs();
+
+	while ((r = read(bus->fd, bus->buf + bus->resp.len, frameMissing(&bus->resp))) > 0)
+		if (frameReceived(&bus->resp, r))
+		{
+			busReply(R, bus);
+			return;
+		}
+
+	if (r < 0 && errno != EAGAIN)
+	{
+		busFailure(R, bus, "Read failed.");
+		return;
+	}
+
+	// Wait for the rest of the frame
+	armTimer(bus->timer, FRAME_GAP(bus->baud));
+}
+
+// -- Bus timer has expired: the meter doesn't answer or the frame is over
+void busTimeout(Reactor* R, Bus* bus)
+{
+	uint64_t expirations;
+
+	// The timer could be rearmed after the expiration was queued
+	if (read(bus->timer, &expirations, sizeof(expirations)) != sizeof(expirations) || !bus->busy)
+		return;
+
+	// The retry backoff is over
+	if (bus->backoff)
+	{
+		busSend(R, bus);
+		return;
+	}
+
+	if (bus->resp.len > 0)
+	{
+		busReply(R, bus);
+		return;
+	}
+
+	txRecord(&bus->meters[bus->meter].stats, &bus->resp, CHECK_CHANNEL_TIME_OUT);
+	if (busRetry(bus, CHECK_CHANNEL_TIME_OUT))
+		return;
+
+	if (STEP_CHECK == bus->step)
+	{
+		if (debugPrint)
+			printf("Power meter #%d doesn't answer.\n\r", bus->meters[bus->meter].address);
+		bus->meters[bus->meter].online = 0;
+		bus->meters[bus->meter].failure = "Power meter doesn't answer.";
+		busNextMeter(R, bus);
+	}
+	else
+		busFailure(R, bus, "Communication channel timeout.");
+}
+
+// -- Check if the broker clients have requested any meter of the bus
+int busPending(Bus* bus)
+{
+	for (int m = 0; m < bus->meterNum; m++)
+		if (bus->meters[m].pending)
+			return 1;
+	return 0;
+}
+
+// -- Parse the parameter groups letters of the broker request, all the groups if empty
+// -- Returns the groups bit mask or 0 if invalid.
+int parseGroups(const char* list)
+{
+	int groups = 0;
+
+	for (; *list; list++)
+	{
+		int g = 0;
+		while (g < GROUP_NUM && *list != groupName[g][0])
+			g++;
+		if (g == GROUP_NUM)
+			return 0;
+		groups |= 1 << g;
+	}
+
+	return groups ? groups : (1 << GROUP_NUM) - 1;
+}
+
+// -- Disconnect the broker client
+void clientClose(Reactor* R, Client* c)
+{
+	epoll_ctl(R->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->meter = NULL;
+}
+
+// -- Send the reply to the broker client, the client is dropped if it doesn't take it at once
+void clientSend(Reactor* R, Client* c, const char* data, size_t len)
+{
+	if (send(c->fd, data, len, MSG_NOSIGNAL) != len)
+		clientClose(R, c);
+}
+
+// -- Wait for the requests of the broker client or stop reading them until the reply
+void clientListen(Reactor* R, Client* c, int on)
+{
+	struct epoll_event ev;
+	ev.events = on ? EPOLLIN : 0;
+	ev.data.u32 = REACTOR_CLIENT | (c - R->clients);
+	epoll_ctl(R->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// -- Send the meter data or the poll failure to the broker client
+void clientSendOutput(Reactor* R, Client* c, Bus* bus, Meter* meter)
+{
+	char* data;
+	size_t len;
+
+	FILE* out = open_memstream(&data, &len);
+	if (meter->failure)
+		fprintf(out, "ERR %s\n\r", meter->failure);
+	else
+		printOutput(out, R->format, meter, R->header, R->showAddress, (R->busNum > 1) ? bus->dev : NULL);
+	fclose(out);
+
+	clientSend(R, c, data, len);
+	free(data);
+}
+
+// -- Send the cache statistics by groups and the transaction statistics by meters to the broker client
+void clientSendStats(Reactor* R, Client* c)
+{
+	char* data;
+	size_t len;
+
+	FILE* out = open_memstream(&data, &len);
+	for (int g = 0; g < GROUP_NUM; g++)
+		fprintf(out, "%s\"%s\":{\"hits\":%ld,\"misses\":%ld,\"refreshes\":%ld}",
+			g ? "," : "{\"cache\":{", groupName[g], cacheStats[g].hits, cacheStats[g].misses, cacheStats[g].refreshes);
+	fprintf(out, "},\"meters\":[");
+	for (int i = 0, first = 1; i < R->busNum; i++)
+		for (int m = 0; m < R->buses[i].meterNum; m++, first = 0)
+		{
+			if (!first)
+				fprintf(out, ",");
+			printStats(out, &R->buses[i].meters[m], R->buses[i].dev);
+		}
+	fprintf(out, "]}\n\r");
+	fclose(out);
+
+	clientSend(R, c, data, len);
+	free(data);
+}
+
+// -- Serve the request for the meter data
+// -- The groups read within their TTL are replied from the cache. The stale ones are replied too,
+// -- one refresh is queued for them in the background. The client waits for the poll of the rest.
+// -- Single-flight: the poll in progress is shared if it reads the groups requested,
+// -- all the requests coming in meanwhile are merged into the next poll.
+void brokerRequest(Reactor* R, Client* c, Bus* bus, Meter* meter, int groups)
+{
+	int current = bus->busy && &bus->meters[bus->meter] == meter && meter->due;
+	int polling = meter->pending | (current ? meter->due : 0);
+	int missing = 0;
+	time_t now = time(NULL);
+
+	for (int g = 0; g < GROUP_NUM; g++)
+	{
+		if (!(groups & (1 << g)))
+			continue;
+
+		if (!groupTTL[g] || !meter->updated[g])
+		{
+			missing |= 1 << g;
+			cacheStats[g].misses++;
+			continue;
+		}
+
+		cacheStats[g].hits++;
+		if (now - meter->updated[g] >= groupTTL[g] && !(polling & (1 << g)))
+		{
+			meter->pending |= 1 << g;
+			cacheStats[g].refreshes++;
+		}
 	}
 
-	return checkResult;
+	if (!missing)
+		clientSendOutput(R, c, bus, meter);
+	else
+	{
+		c->bus = bus;
+		c->meter = meter;
+		if (current && (meter->due & missing) == missing)
+			c->poll = meter->polls + 1;
+		else
+		{
+			meter->pending |= missing;
+			c->poll = meter->polls + (current ? 2 : 1);
+		}
+		clientListen(R, c, 0);
+	}
+
+	if (!bus->busy && meter->pending)
+		busStartCycle(R, bus);
 }
 
-// -- Command line usage help
-void printUsage()
+// -- Handle the request lines of the broker client: [PORT] ADDR [GROUPS]
+// -- The port is to be named if the meter address is on several dongles.
+void clientRequest(Reactor* R, Client* c)
 {
-	printf("Usage: mercury236 RS485 [OPTIONS] ...\n\r\n\r");
-	printf("  RS485\t\taddress of RS485 dongle (e.g. /dev/ttyUSB0), required\n\r");
-	printf("  %s\tto print extra debug info\n\r", OPT_DEBUG);
-	printf("  %s\tdry run to see output sample, no hardware required\n\r", OPT_TEST_RUN);
-	printf("\n\r");
-	printf("  Output formatting:\n\r");
-	printf("  %s\thuman readable (default)\n\r", OPT_HUMAN);
-	printf("  %s\t\tCSV\n\r", OPT_CSV);
-	printf("  %s\tjson\n\r", OPT_JSON);
-	printf("  %s\tto print data header (with %s only)\n\r", OPT_HEADER, OPT_CSV);
-	printf("\n\r");
-	printf("  %s\tprints this screen\n\r", OPT_HELP);
+	char* eol;
+
+	while (c->fd >= 0 && !c->meter && (eol = memchr(c->req, '\n', c->len)))
+	{
+		char line[BSZ], groups[BSZ] = "";
+		int used = eol - c->req + 1;
+		char* end;
+
+		memcpy(line, c->req, used - 1);
+		line[used - 1] = 0;
+		c->len -= used;
+		memmove(c->req, eol + 1, c->len);
+
+		// STATS command: nothing but the whitespace is to follow it, as with the data requests
+		int n = 0;
+		if (sscanf(line, " %254s%n", groups, &n) == 1 && !strcmp(groups, "STATS"))
+		{
+			if (line[n + strspn(line + n, " \t\r")])
+				clientSend(R, c, "ERR Invalid request.\n\r", 22);
+			else
+				clientSendStats(R, c);
+			continue;
+		}
+
+		// The address is a number, the port is anything else
+		char* p = line + strspn(line, " \t\r");
+		size_t len = strcspn(p, " \t\r");
+		const char* port = NULL;
+		if (len && !isNumber(p, len))
+		{
+			port = p;
+			p += len;
+			if (*p)
+				*p++ = 0;
+		}
+
+		// Nothing but the whitespace is to follow the groups
+		long addr = strtol(p, &end, 10);
+		n = 0;
+		groups[0] = 0;
+		sscanf(end, " %254s%n", groups, &n);
+		if (end == p || end[n + strspn(end + n, " \t\r")] || !parseGroups(groups))
+		{
+			clientSend(R, c, "ERR Invalid request.\n\r", 22);
+			continue;
+		}
+
+		// The meters are looked up by the buses: the same address could be used on every dongle
+		Bus* bus = NULL;
+		Meter* meter = NULL;
+		int found = 0;
+		for (int i = 0; i < R->busNum; i++)
+			for (int m = 0; m < R->buses[i].meterNum; m++)
+				if (R->buses[i].meters[m].address == addr && (!port || !strcmp(port, R->buses[i].dev)))
+				{
+					bus = &R->buses[i];
+					meter = &bus->meters[m];
+					found++;
+				}
+
+		if (!found)
+			clientSend(R, c, "ERR Unknown power meter.\n\r", 26);
+		else if (found > 1)
+			clientSend(R, c, "ERR Power meter address is on several ports, name the port.\n\r", 61);
+		else
+			brokerRequest(R, c, bus, meter, parseGroups(groups));
+	}
 }
 
-// -- Output formatting and print
-void printOutput(int format, OutputBlock o, int header)
+// -- Reply to the broker client waiting for the meter poll
+void clientReply(Reactor* R, Client* c)
 {
-	// getting current time for timestamp
-	char timeStamp[BSZ];
-	getDateTimeStr(timeStamp, BSZ, time(NULL));
+	Meter* meter = c->meter;
 
-	switch(format)
+	c->meter = NULL;
+	clientSendOutput(R, c, c->bus, meter);
+
+	if (c->fd >= 0)
 	{
-		case OF_HUMAN:
-			printf("  Voltage (V):             		%8.2f %8.2f %8.2f\n\r", o.U.p1, o.U.p2, o.U.p3);
-			printf("  Current (A):             		%8.2f %8.2f %8.2f\n\r", o.I.p1, o.I.p2, o.I.p3);
-			printf("  Cos(f):                  		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.C.p1, o.C.p2, o.C.p3, o.C.sum);
-			printf("  Frequency (Hz):          		%8.2f\n\r", o.f);
-			printf("  Phase angles (deg):      		%8.2f %8.2f %8.2f\n\r", o.A.p1, o.A.p2, o.A.p3);
-			printf("  Active power (W):        		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.P.p1, o.P.p2, o.P.p3, o.P.sum);
-			printf("  Reactive power (VA):     		%8.2f %8.2f %8.2f (%8.2f)\n\r", o.S.p1, o.S.p2, o.S.p3, o.S.sum);
-			printf("  Total consumed, all tariffs (KW):	%8.2f\n\r", o.PR.ap);
-			printf("    including day tariff (KW):		%8.2f\n\r", o.PRT[0].ap);
-			printf("    including night tariff (KW):	%8.2f\n\r", o.PRT[1].ap);
-			printf("  Yesterday consumed (KW): 		%8.2f\n\r", o.PY.ap);
-			printf("  Today consumed (KW):     		%8.2f\n\r", o.PT.ap);
+		clientListen(R, c, 1);
+		clientRequest(R, c);
+	}
+}
+
+// -- The meter poll is over, reply to the clients waiting for it
+void brokerReply(Reactor* R, Meter* meter)
+{
+	meter->polls++;
+	meter->due = 0;
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+	{
+		Client* c = &R->clients[i];
+		if (c->fd >= 0 && c->meter == meter && c->poll <= meter->polls)
+			clientReply(R, c);
+	}
+}
+
+// -- Broker client input is ready or it has disconnected
+void clientEvent(Reactor* R, Client* c, uint32_t events)
+{
+	if (c->fd < 0)
+		return;
+
+	if (events & (EPOLLHUP | EPOLLERR))
+	{
+		clientClose(R, c);
+		return;
+	}
+
+	int r = read(c->fd, c->req + c->len, sizeof(c->req) - c->len);
+	if (r == 0 || (r < 0 && errno != EAGAIN))
+	{
+		clientClose(R, c);
+		return;
+	}
+
+	if (r > 0)
+		c->len += r;
+	clientRequest(R, c);
+
+	if (c->fd >= 0 && !c->meter && c->len == sizeof(c->req))
+	{
+		clientSend(R, c, "ERR Request is too long.\n\r", 26);
+		if (c->fd >= 0)
+			clientClose(R, c);
+	}
+}
+
+// -- Accept the broker client
+void brokerAccept(Reactor* R)
+{
+	struct epoll_event ev;
+
+	int fd = accept(R->listenFd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	int i = 0;
+	while (i < MAX_CLIENTS && R->clients[i].fd >= 0)
+		i++;
+	if (i == MAX_CLIENTS)
+	{
+		close(fd);
+		return;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	bzero(&R->clients[i], sizeof(Client));
+	R->clients[i].fd = fd;
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = REACTOR_CLIENT | i;
+	epoll_ctl(R->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// -- Open the broker Unix socket
+void brokerListen(Reactor* R)
+{
+	struct sockaddr_un sa;
+	struct epoll_event ev;
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		R->clients[i].fd = -1;
+
+	bzero(&sa, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, R->broker, sizeof(sa.sun_path) - 1);
+	unlink(R->broker);
+
+	R->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (R->listenFd < 0 || bind(R->listenFd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(R->listenFd, MAX_CLIENTS) < 0)
+		exitFailure("Broker socket creation failed.");
+	fcntl(R->listenFd, F_SETFL, O_NONBLOCK);
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = REACTOR_LISTEN;
+	epoll_ctl(R->epfd, EPOLL_CTL_ADD, R->listenFd, &ev);
+}
+
+// -- Close the broker socket and disconnect the clients
+void brokerClose(Reactor* R)
+{
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		if (R->clients[i].fd >= 0)
+			clientClose(R, &R->clients[i]);
+
+	close(R->listenFd);
+	unlink(R->broker);
+}
+
+// -- Poll all the buses at the same time from the single epoll loop
+// -- Every bus runs its own transaction state machine, the poll cycle takes as long as the slowest bus.
+void runReactor(Reactor* R, int interval)
+{
+	struct epoll_event ev, events[2 * MAX_PORTS + MAX_CLIENTS + 2];
+	int tick = -1;
+
+	int epfd = R->epfd = epoll_create1(0);
+	if (epfd < 0)
+		exitFailure("Epoll creation failed.");
+
+	for (int i = 0; i < R->busNum; i++)
+	{
+		Bus* bus = &R->buses[i];
+
+		bus->fd = openPort(bus->dev, &bus->oldtio);
+		bus->baud = portSpeed(bus->fd, bus->dev, bus->meters, bus->meterNum);
+		for (int m = 0; m < bus->meterNum; m++)
+			bus->meters[m].baud = bus->baud;
+		fcntl(bus->fd, F_SETFL, O_NONBLOCK);
+
+		bus->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (bus->timer < 0)
+			exitFailure("Timer creation failed.");
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = i << 1;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, bus->fd, &ev);
+		ev.data.u32 = (i << 1) | 1;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, bus->timer, &ev);
+	}
+
+	// Poll cycles start by the interval timer in daemon mode, overrunning buses skip the tick
+	// The broker polls the meters on the client requests only.
+	if (R->broker)
+		brokerListen(R);
+	else if (R->daemonMode)
+	{
+		struct itimerspec t;
+		bzero(&t, sizeof(t));
+		t.it_value.tv_sec = t.it_interval.tv_sec = interval;
+
+		tick = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (tick < 0)
+			exitFailure("Timer creation failed.");
+		timerfd_settime(tick, 0, &t, NULL);
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = REACTOR_TICK;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, tick, &ev);
+
+	}
+
+	if (R->daemonMode)
+	{
+		signal(SIGINT, onStopSignal);
+		signal(SIGTERM, onStopSignal);
+		if (statsReactor)
+			signal(SIGUSR1, onStatsSignal);
+	}
+
+	for (int i = 0; i < R->busNum && !R->broker; i++)
+		busStartCycle(R, &R->buses[i]);
+
+	while (!stopRequested)
+	{
+		checkStatsRequest();
+
+		int busy = 0;
+		for (int i = 0; i < R->busNum; i++)
+			busy |= R->buses[i].busy;
+		if (!busy && !R->daemonMode)
 			break;
 
-		case OF_CSV:
-			if (header)
-			{
-				// to be the same order as params below
-				printf("DT,U1,U2,U3,I1,I2,I3,P1,P2,P2,Psum,S1,S2,S3,Ssum,C1,C2,C3,Csum,F,A1,A2,A3,PRa,PYa,PTa\n\r");
+		int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			exitFailure("Epoll wait failed.");
+		}
+
+		for (int e = 0; e < n; e++)
+		{
+			uint32_t id = events[e].data.u32;
 
+			if (REACTOR_TICK == id)
+			{
+				uint64_t expirations;
+				if (read(tick, &expirations, sizeof(expirations)) == sizeof(expirations))
+					for (int i = 0; i < R->busNum; i++)
+						if (!R->buses[i].busy)
+							busStartCycle(R, &R->buses[i]);
+				zabbixFlushDue();
 			}
-			printf("%s,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n\r",
-				timeStamp,
-				o.U.p1, o.U.p2, o.U.p3,
-				o.I.p1, o.I.p2, o.I.p3,
-				o.P.p1, o.P.p2, o.P.p3, o.P.sum,
-				o.S.p1, o.S.p2, o.S.p3, o.S.sum,
-				o.C.p1, o.C.p2, o.C.p3, o.C.sum,
-				o.f,
-				o.A.p1, o.A.p2, o.A.p3,
-				o.PR.ap, o.PRT[0].ap, o.PRT[1].ap,
-				o.PY.ap,
-				o.PT.ap
-			);
-			break;
+			else if (REACTOR_LISTEN == id)
+				brokerAccept(R);
+			else if (id & REACTOR_CLIENT)
+				clientEvent(R, &R->clients[id & ~REACTOR_CLIENT], events[e].events);
+			else if (id & 1)
+				busTimeout(R, &R->buses[id >> 1]);
+			else
+				busReadable(R, &R->buses[id >> 1]);
+		}
+	}
 
-		case OF_JSON:
-			printf("{\"U\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f},\"I\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f},\"CosF\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f},\"F\":%.2f,\"A\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f},\"P\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f},\"S\":{\"p1\":%.2f,\"p2\":%.2f,\"p3\":%.2f,\"sum\":%.2f},\"PR\":{\"ap\":%.2f},\"PR-day\":{\"ap\":%.2f},\"PR-night\":{\"ap\":%.2f},\"PY\":{\"ap\":%.2f},\"PT\":{\"ap\":%.2f}}\n\r",
-				o.U.p1, o.U.p2, o.U.p3,
-				o.I.p1, o.I.p2, o.I.p3,
-				o.C.p1, o.C.p2, o.C.p3, o.C.sum,
-				o.f,
-				o.A.p1, o.A.p2, o.A.p3,
-				o.P.p1, o.P.p2, o.P.p3, o.P.sum,
-				o.S.p1, o.S.p2, o.S.p3, o.S.sum,
-				o.PR.ap, o.PRT[0].ap, o.PRT[1].ap,
-				o.PY.ap,
-				o.PT.ap
-			);
-			break;
+	for (int i = 0; i < R->busNum; i++)
+	{
+		Bus* bus = &R->buses[i];
 
-		default:
-			exitFailure("Invalid formatting.");
-			break;
+		// Sessions left open in daemon mode
+		fcntl(bus->fd, F_SETFL, 0);
+		for (int m = 0; m < bus->meterNum; m++)
+			if (bus->meters[m].online)
+				closeConnection(bus->fd, &bus->meters[m]);
+
+		close(bus->timer);
+		closePort(bus->fd, &bus->oldtio);
+	}
+
+	if (R->broker)
+		brokerClose(R);
+	if (tick >= 0)
+		close(tick);
+	close(epfd);
+}
+
+// -- Poll the meters on several RS485 dongles concurrently
+void pollBuses(char** ports, char** addrs, int portNum, Meter* meters, int meterNum,
+	int format, int header, int showAddress, int daemonMode, int interval, int dryRun, const char* broker, int stats)
+{
+	static Reactor R;
+
+	bzero(&R, sizeof(R));
+	if (stats)
+		statsReactor = &R;
+	R.format = format;
+	R.header = header;
+	R.showAddress = showAddress;
+	R.daemonMode = daemonMode || broker;
+	R.broker = broker;
+	R.busNum = portNum;
+
+	// Each dongle polls its own addresses, the --address ones if not given
+	for (int i = 0; i < portNum; i++)
+	{
+		Bus* bus = &R.buses[i];
+
+		bus->dev = ports[i];
+		if (addrs[i])
+			bus->meterNum = parseAddresses(addrs[i], bus->meters);
+		else
+		{
+			bus->meterNum = meterNum;
+			memcpy(bus->meters, meters, meterNum * sizeof(Meter));
+		}
 	}
+
+	if (!dryRun)
+		runReactor(&R, interval);
+
+	if (R.daemonMode)
+		return;
+
+	// print the results
+	for (int i = 0; i < R.busNum; i++)
+		for (int m = 0; m < R.buses[i].meterNum; m++)
+		{
+			Meter* meter = &R.buses[i].meters[m];
+			outputMeter(format, meter, R.header, showAddress, R.buses[i].dev);
+			R.header = 0;
+		}
 }
 
+#ifndef MERCURY_LIBRARY
 int main(int argc, const char** args)
 {
 	int fd, dryRun = 0, format = OF_HUMAN, header = 0;
-	struct termios oldtio, newtio;
+	int daemonMode = 0, interval = DEF_INTERVAL;
+	int meterNum = 0, showAddress = 0, stats = 0;
+	int profile = 0, constant = DEF_CONSTANT;	// 1 - time range, 2 - sync
+	int counters = 0, tariffs = MAX_TARIFFS;
+	time_t profileFrom = 0, profileTo = 0;
+	const char* broker = NULL;
+	static Meter meters[MAX_METERS];
+	int portNum;
+	struct termios oldtio;
 	char dev[BSZ];
+	char* ports[MAX_PORTS];
+	char* addrs[MAX_PORTS];
 
 	// get RS485 address (1st required param)
 	if (argc < 2)
@@ -823,6 +3668,35 @@ int main(int argc, const char** args)
 			debugPrint = 1;
 		else if (!strcmp(OPT_TEST_RUN, args[i]))
 			dryRun = 1;
+		else if (!strcmp(OPT_FIXED_DELAY, args[i]))
+			fixedDelay = 1;
+		else if (!strcmp(OPT_RETRIES, args[i]) && i+1 < argc && atoi(args[i+1]) >= 0)
+			txRetries = atoi(args[++i]);
+		else if (!strcmp(OPT_BAUD, args[i]) && i+1 < argc)
+		{
+			i++;
+			if (!strcmp(args[i], "auto"))
+				baudRate = BAUD_AUTO;
+			else if (findBaud(atoi(args[i])))
+				baudRate = atoi(args[i]);
+			else
+			{
+				printf("Error: invalid %s %s\n\r\n\r", OPT_BAUD, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+		}
+		else if (!strcmp(OPT_BREAKER, args[i]) && i+1 < argc && atoi(args[i+1]) >= 0)
+			breakerTimeouts = atoi(args[++i]);
+		else if (!strcmp(OPT_TIMEOUT, args[i]) && i+1 < argc)
+		{
+			if (!parseTimeouts(args[++i]))
+			{
+				printf("Error: invalid %s %s\n\r\n\r", OPT_TIMEOUT, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+		}
 		else if (!strcmp(OPT_HUMAN, args[i]))
 			format = OF_HUMAN;
 		else if (!strcmp(OPT_CSV, args[i]))
@@ -831,6 +3705,84 @@ int main(int argc, const char** args)
 			format = OF_JSON;
 		else if (!strcmp(OPT_HEADER, args[i]))
 			header = 1;
+		else if (!strcmp(OPT_ADDRESS, args[i]) && i+1 < argc)
+		{
+			meterNum = parseAddresses(args[++i], meters);
+			if (!meterNum)
+			{
+				printf("Error: invalid %s list %s\n\r\n\r", OPT_ADDRESS, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+			showAddress = 1;
+		}
+		else if (!strcmp(OPT_SCHEDULE, args[i]) && i+1 < argc)
+		{
+			if (!parseSchedule(args[++i], groupPeriod))
+			{
+				printf("Error: invalid %s %s\n\r\n\r", OPT_SCHEDULE, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+			scheduled = 1;
+		}
+		else if (!strcmp(OPT_FIELDS, args[i]) && i+1 < argc)
+		{
+			if (!parseFields(args[++i]))
+			{
+				printf("Error: invalid %s %s\n\r\n\r", OPT_FIELDS, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+		}
+		else if (!strcmp(OPT_DAEMON, args[i]))
+			daemonMode = 1;
+		else if (!strcmp(OPT_STATS, args[i]))
+			stats = 1;
+		else if (!strcmp(OPT_PROFILE, args[i]) && i+2 < argc)
+		{
+			profileFrom = parseTime(args[++i]);
+			profileTo = parseTime(args[++i]);
+			if (profileFrom < 0 || profileTo < profileFrom)
+			{
+				printf("Error: invalid %s time range %s %s\n\r\n\r", OPT_PROFILE, args[i-1], args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+			profile = 1;
+		}
+		else if (!strcmp(OPT_SYNC, args[i]))
+			profile = 2;
+		else if (!strcmp(OPT_COUNTERS, args[i]) && i+1 < argc && !strcmp("all", args[i+1]))
+		{
+			counters = 1;
+			i++;
+		}
+		else if (!strcmp(OPT_TARIFFS, args[i]) && i+1 < argc && atoi(args[i+1]) > 0 && atoi(args[i+1]) <= MAX_TARIFFS)
+			tariffs = atoi(args[++i]);
+		else if (!strcmp(OPT_CONSTANT, args[i]) && i+1 < argc && atoi(args[i+1]) > 0)
+			constant = atoi(args[++i]);
+		else if (!strcmp(OPT_BROKER, args[i]) && i+1 < argc)
+			broker = args[++i];
+		else if (!strcmp(OPT_ZABBIX, args[i]) && i+1 < argc)
+			parseZabbixServer((char*)args[++i]);
+		else if (!strcmp(OPT_ZABBIX_HOST, args[i]) && i+1 < argc)
+			strncpy(zabbixHost, args[++i], BSZ - 1);
+		else if (!strcmp(OPT_FLUSH_SIZE, args[i]) && i+1 < argc && atoi(args[i+1]) > 0)
+			zabbixFlushSize = atoi(args[++i]);
+		else if (!strcmp(OPT_FLUSH_INT, args[i]) && i+1 < argc && atoi(args[i+1]) >= 0)
+			zabbixFlushInterval = atoi(args[++i]);
+		else if (!strcmp(OPT_TTL, args[i]) && i+1 < argc)
+		{
+			if (!parseSchedule(args[++i], groupTTL))
+			{
+				printf("Error: invalid %s %s\n\r\n\r", OPT_TTL, args[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+		}
+		else if (!strcmp(OPT_INTERVAL, args[i]) && i+1 < argc && atoi(args[i+1]) > 0)
+			interval = atoi(args[++i]);
 		else if (!strcmp(OPT_HELP, args[i]))
 		{
 			printUsage();
@@ -844,94 +3796,179 @@ int main(int argc, const char** args)
 		}
 	}
 
-	OutputBlock o;
-	bzero(&o, sizeof(o));
-
-	if (!dryRun)
+	if (!meterNum)
 	{
-		// Open RS485 dongle
-		fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY);
-		if (fd < 0)
-			exitFailure(dev);
+		bzero(&meters[0], sizeof(Meter));
+		meters[0].address = PM_ADDRESS;
+		meterNum = 1;
+	}
 
-		fcntl(fd, F_SETFL, 0);
+	// The samples left in the Zabbix sender batch are sent on exit
+	if (zabbixServer)
+	{
+		if (!zabbixHost[0])
+			gethostname(zabbixHost, BSZ - 1);
+		atexit(zabbixFlush);
+	}
 
-		tcgetattr(fd, &oldtio); /* save current port settings */
+	// The statistics are printed on failures too
+	if (stats)
+		atexit(dumpStats);
 
-		bzero(&newtio, sizeof(newtio));
+	portNum = parsePorts(dev, ports, addrs);
+	if (!portNum)
+	{
+		printf("Error: invalid RS485 dongles list %s\n\r\n\r", args[1]);
+		printUsage();
+		exit(EXIT_FAIL);
+	}
 
-		cfsetispeed(&newtio, BAUDRATE);
-		cfsetospeed(&newtio, BAUDRATE);
+	// The addresses given by the dongles are printed and override the --address ones on the single dongle
+	for (int i = 0; i < portNum; i++)
+		if (addrs[i])
+		{
+			static Meter check[MAX_METERS];
+			if (!parseAddresses(addrs[i], check))
+			{
+				printf("Error: invalid %s addresses list %s\n\r\n\r", ports[i], addrs[i]);
+				printUsage();
+				exit(EXIT_FAIL);
+			}
+			showAddress = 1;
+		}
+	if (addrs[0] && 1 == portNum)
+		meterNum = parseAddresses(addrs[0], meters);
 
-		newtio.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-	//	newtio.c_cflag = BAUDRATE | CRTSCTS | CS8 | CLOCAL | CREAD;
-	//	newtio.c_cflag = BAUDRATE | CS8 | CREAD;
-		newtio.c_iflag = IGNPAR;
-		newtio.c_oflag = 0;
+	// The archives are downloaded from one dongle at a time
+	if ((profile || counters) && (portNum > 1 || broker || daemonMode))
+	{
+		printf("Error: %s, %s and %s are for the single RS485 dongle one-time run\n\r\n\r", OPT_PROFILE, OPT_SYNC, OPT_COUNTERS);
+		printUsage();
+		exit(EXIT_FAIL);
+	}
 
-		cfmakeraw(&newtio);
-		tcsetattr(fd, TCSANOW, &newtio);
+	// Several dongles are polled concurrently, the broker runs the same reactor
+	if (portNum > 1 || broker)
+	{
+		pollBuses(ports, addrs, portNum, meters, meterNum, format, header, showAddress, daemonMode, interval, dryRun, broker, stats);
+		exit(EXIT_OK);
+	}
 
-		switch(checkChannel(fd))
+	if (!dryRun)
+	{
+		fd = openPort(ports[0], &oldtio);
+		portBaud = portSpeed(fd, ports[0], meters, meterNum);
+		if (stats)
 		{
-			case OK:
-				if (OK != initConnection(fd))
-					exitFailure("Power meter connection initialisation error.");
+			statsMeters = meters;
+			statsMeterNum = meterNum;
+		}
 
-				// Get voltage by phases
-				if (OK != getU(fd, &o.U))
-					exitFailure("Cannot collect voltage data.");
+		if (daemonMode)
+		{
+			signal(SIGINT, onStopSignal);
+			signal(SIGTERM, onStopSignal);
+			if (stats)
+				signal(SIGUSR1, onStatsSignal);
 
-				// Get current by phases
-				if (OK != getI(fd, &o.I))
-					exitFailure("Cannot collect current data.");
+			// Only the data reads are repeated, the sessions stay open between the samples
+			while (!stopRequested)
+			{
+				time_t started = time(NULL);
+
+				for (int m = 0; m < meterNum && !stopRequested; m++)
+				{
+					Meter* meter = &meters[m];
+
+					// Meters not answering are probed again every cycle until the breaker cuts them off
+					if (!meter->online && !probeDue(meter, time(NULL)))
+						continue;
+					if (OK != pollMeter(fd, meter, 1))
+						continue;
+
+					outputMeter(format, meter, header, showAddress, NULL);
+					header = 0;
+				}
+				fflush(stdout);
+				zabbixFlushDue();
+
+				// The statistics requests interrupt the sleep
+				int left = interval - (time(NULL) - started);
+				while (left > 0 && !stopRequested)
+				{
+					left = sleep(left);
+					checkStatsRequest();
+				}
+			}
+		}
+		else if (profile)
+		{
+			if (OF_CSV == format && header)
+				printf("DT,%sPeriod,Pp,Pm,Qp,Qm\n\r", showAddress ? "Addr," : "");
 
-				// Get power cos(f) by phases
-				if (OK != getCosF(fd, &o.C))
-					exitFailure("Cannot collect cos(f) data.");
+			for (int m = 0; m < meterNum; m++)
+			{
+				Meter* meter = &meters[m];
 
-				// Get grid frequency
-				if (OK != getF(fd, &o.f))
-					exitFailure("Cannot collect grid frequency data.");
+				meter->online = (OK == openSession(fd, meter));
+				if (!meter->online)
+					continue;
 
-				// Get phase angles
-				if (OK != getA(fd, &o.A))
-					exitFailure("Cannot collect phase angles data.");
+				int r = (2 == profile) ? syncProfile(fd, meter, format, showAddress, constant) :
+					readProfile(fd, meter, profileFrom, profileTo, format, showAddress, constant);
+				if (r < 0)
+					fprintf(stderr, "Power meter #%d: cannot read the load profile.\n", meter->address);
+			}
+		}
+		else if (counters)
+		{
+			if (OF_CSV == format && header)
+				printf("%sPeriod,Month,Tariff,Ap,Am,Rp,Rm,Read\n\r", showAddress ? "Addr," : "");
 
-				// Get active power consumption by phases
-				if (OK != getP(fd, &o.P))
-					exitFailure("Cannot collect active power consumption data.");
+			for (int m = 0; m < meterNum; m++)
+			{
+				Meter* meter = &meters[m];
 
-				// Get reactive power consumption by phases
-				if (OK != getS(fd, &o.S))
-					exitFailure("Cannot collect reactive power consumption data.");
+				meter->online = (OK == openSession(fd, meter));
+				if (meter->online && syncCounters(fd, meter, tariffs, format, showAddress) < 0)
+					fprintf(stderr, "Power meter #%d: cannot read the energy counters.\n", meter->address);
+			}
+		}
+		else
+		{
+			for (int m = 0; m < meterNum; m++)
+			{
+				Meter* meter = &meters[m];
 
-				// Get power counter from reset, for yesterday and today
-				if (OK != getW(fd, &o.PR, PP_RESET, 0, 0) ||		// total from reset
-    				    OK != getW(fd, &o.PRT[0], PP_RESET, 0, 0+1) ||	// day tariff from reset
-	    			    OK != getW(fd, &o.PRT[1], PP_RESET, 0, 1+1) ||	// night tariff from reset
-				    OK != getW(fd, &o.PY, PP_YESTERDAY, 0, 0) ||
-				    OK != getW(fd, &o.PT, PP_TODAY, 0, 0))
-					exitFailure("Cannot collect power counters data.");
+				// The meter not answering gets zeros in the output, the other failures are fatal here
+				int r = pollMeter(fd, meter, 0);
+				if (OK != r && CHECK_CHANNEL_TIME_OUT != r)
+					exitFailure(meter->failure);
+			}
+		}
 
-				if (OK != closeConnection(fd))
+		// The meter gone silent just leaves the session to expire
+		for (int m = 0; m < meterNum; m++)
+			if (meters[m].online)
+			{
+				int r = closeConnection(fd, &meters[m]);
+				if (OK != r && CHECK_CHANNEL_TIME_OUT != r)
 					exitFailure("Power meter connection closing error.");
+			}
 
-				break;
-
-			case CHECK_CHANNEL_TIME_OUT:
-				break;
-
-			default:
-				exitFailure("Power meter communication channel test failed.");
-		}
+		closePort(fd, &oldtio);
 
-		close(fd);
-		tcsetattr(fd, TCSANOW, &oldtio);
+		if (daemonMode || profile || counters)
+			exit(EXIT_OK);
 	}
 
 	// print the results
-	printOutput(format, o, header);
+	for (int m = 0; m < meterNum; m++)
+	{
+		outputMeter(format, &meters[m], header, showAddress, NULL);
+		header = 0;
+	}
 
 	exit(EXIT_OK);
 }
+#endif
@@ -0,0 +1,256 @@
+/*
+ *	Mercury 236 power meter embedding API: non-blocking poll of the meter driven by the caller event loop.
+ *
+ *	The API is built into libmercury236.a (mercury236.c compiled with -DMERCURY_LIBRARY, no main).
+ */
+#ifndef MERCURY236_H
+#define MERCURY236_H
+
+#include <stddef.h>
+#include <time.h>
+
+// Usage:
+//
+//	#include "mercury236.h"			// linked with libmercury236.a
+//
+//	MercuryCtx ctx;
+//	mercury_init(&ctx, fd, address, 9600);		// raw port opened non-blocking by the caller
+//	mercury_start(&ctx);
+//	MercuryWait w = mercury_step(&ctx, 0, nowMs());
+//	while (w.interest)
+//	{
+//		wait for w.interest on ctx.fd until w.deadline (CLOCK_MONOTONIC ms, see nowMs), 0 - no deadline
+//		w = mercury_step(&ctx, events ready, nowMs());
+//	}
+//	ctx.meter.o holds the values read, ctx.meter.valid their validity bits, ctx.meter.failure the reason of the failure
+//
+// The API prints nothing and never exits: the debug messages go to ctx.meter.log if the caller sets it. The values
+// read are set by ctx.meter.fields (FIELD_BIT mask of the data steps, all by default). The contexts share just
+// the protocol options (retries, timeouts, breaker), so any number of them could be driven by one thread.
+// The meters on the same port are polled one after another.
+
+#define BSZ		255
+#define TARRIF_NUM	2		// 2 tariffs supported
+#define HIST_BUCKETS	10		// Transaction time histogram buckets
+#define PLAN_SIZE	128		// Request frames of the poll cycle steps of the meter (bytes)
+
+// The protocol structures are packed, the same layout for the library and its callers
+#pragma pack(push, 1)
+
+// 3-phase vector (for voltage, frequency, power by phases)
+typedef struct
+{
+	float	p1;
+	float	p2;
+	float	p3;
+} P3V;
+
+// 3-phase vector (for voltage, frequency, power by phases) with sum by all phases
+typedef struct
+{
+	float	sum;
+	float	p1;
+	float	p2;
+	float	p3;
+} P3VS;
+
+// Power vector
+typedef struct
+{
+	float 	ap;		// active +
+	float	am;		// active -
+	float 	rp;		// reactive +
+	float 	rm;		// reactive -
+} PWV;
+
+// Output results block
+typedef struct
+{
+	P3V 	U;			// voltage
+	P3V	I;			// current
+	P3V	A;			// phase angles
+	P3VS	C;			// cos(f)
+	P3VS	P;			// current active power consumption
+	P3VS	S;			// current reactive power consumption
+	PWV	PR;			// power counters from reset (all tariffs)
+	PWV	PRT[TARRIF_NUM];	// power counters from reset (by tariffs)
+	PWV	PY;			// power counters for yesterday
+	PWV	PT;			// power counters for today
+	float	f;			// grid frequency
+} OutputBlock;
+
+typedef enum			// Parameter groups polled with their own period
+{
+	G_U = 0,		// voltage
+	G_I,			// current
+	G_C,			// cos(f)
+	G_F,			// grid frequency
+	G_A,			// phase angles
+	G_P,			// active power
+	G_S,			// reactive power
+	G_W,			// power counters
+	GROUP_NUM
+} ParamGroup;
+
+#define AUX_GROUPS	((1 << G_W) - 1)	// Groups read by the auxiliary parameters array
+
+// Responce frame being assembled
+typedef struct
+{
+	unsigned char*	buf;		// BSZ bytes buffer
+	int	off;			// leading junk bytes to skip
+	int	len;			// bytes received
+	int	sz;			// frame size expected
+	double	started;		// request write start (monotonic ms)
+	double	sent;			// request written
+	double	first;			// first responce bytes received, 0 if none yet
+	int	dropped;		// leading junk bytes dropped by frameEnd
+} Frame;
+
+typedef enum			// Transaction outcomes counted
+{
+	TX_OK = 0,
+	TX_TIMEOUT,		// no responce
+	TX_WRONG_CRC,
+	TX_WRONG_SIZE,
+	TX_METER_ERR,		// meter status other than OK (e.g. channel isn't open)
+	TX_OUTCOME_NUM
+} TxOutcome;
+
+// Transactions timing and outcomes of the meter, the timing is of the transactions answered only
+typedef struct
+{
+	long	count[TX_OUTCOME_NUM];
+	double	tx;			// total request write time (ms)
+	double	turnaround;		// total time from the request written to the first responce bytes
+	double	rx;			// total responce receive time
+	double	max;			// longest transaction
+	long	hist[HIST_BUCKETS];	// transactions by time (see histBound)
+} TxStats;
+
+// Power meter on the RS485 bus with its own session state
+typedef struct
+{
+	unsigned char	address;	// RS485 address
+	int		online;		// session is open
+	int		noAuxArray;	// the meter rejects the auxiliary parameters array read
+	int		auxWrongSize;	// consecutive array reads failed with the wrong size responce
+	OutputBlock	o;		// last results collected
+	time_t		cycleStarted;	// current poll cycle start time
+	int		due;		// parameter groups to read within the cycle (bit mask)
+	int		auxDue;		// the array read replaces the per-parameter reads within the cycle
+	time_t		updated[GROUP_NUM];	// parameter groups last read time
+	int		valid;		// output fields holding the values read (bit mask by data steps, see FIELD_BIT)
+	int		pending;	// parameter groups requested by the broker clients for the next poll (bit mask)
+	int		polls;		// number of the broker polls completed
+	const char*	failure;	// last poll failure, NULL if succeeded
+	TxStats		stats;		// transactions statistics
+	int		timeouts;	// consecutive transactions not answered
+	int		probeDelay;	// delay between the probes while the meter is cut off by the breaker (sec), 0 if not
+	time_t		probeAt;	// next probe time of the meter cut off
+	unsigned char	plan[PLAN_SIZE];	// request frames of the poll cycle steps one after another (see stepFrame)
+	int		planned;	// the frames are built
+	int		baud;		// port baud rate of the transfer time estimate, 0 - the blocking loop port one
+	int		fields;		// data steps to read (validity bits, see FIELD_BIT), 0 - the --fields ones
+	void		(*log)(int address, const char* msg);	// debug messages receiver, NULL - printed with --debug
+} Meter;
+
+// Poll cycle steps, one transaction each:
+//	step, command, paramId, BWRI, value size (bytes), values number, scale factor,
+//	output block field, parameter groups updated, responce parts, failure message
+// Steps with no values get 1 byte status responce. Values are decoded in the field layout order
+// (sum first, then by phases), the responce made of parts is decoded as the parts steps values one after another.
+#define OB(field)	offsetof(OutputBlock, field)
+#define POLL_STEPS(X) \
+	X(CHECK, 0x00, 0x00, 0x00, 0, 0, 1.0, 0, 0, NULL, "Power meter communication channel test failed.") \
+	X(INIT, 0x01, 0x00, 0x00, 0, 0, 1.0, 0, 0, NULL, "Power meter connection initialisation error.") \
+	X(AUX, 0x08, 0x14, 0x00, 3, 22, 1.0, 0, AUX_GROUPS, auxParts, "Cannot collect auxiliary parameters data.") \
+	X(U, 0x08, 0x16, 0x11, 3, 3, 100.0, OB(U), 1 << G_U, NULL, "Cannot collect voltage data.") \
+	X(I, 0x08, 0x16, 0x21, 3, 3, 1000.0, OB(I), 1 << G_I, NULL, "Cannot collect current data.") \
+	X(COSF, 0x08, 0x16, 0x30, 3, 4, 1000.0, OB(C), 1 << G_C, NULL, "Cannot collect cos(f) data.") \
+	X(F, 0x08, 0x16, 0x40, 3, 1, 100.0, OB(f), 1 << G_F, NULL, "Cannot collect grid frequency data.") \
+	X(A, 0x08, 0x16, 0x51, 3, 3, 100.0, OB(A), 1 << G_A, NULL, "Cannot collect phase angles data.") \
+	X(P, 0x08, 0x16, 0x00, 3, 4, 100.0, OB(P), 1 << G_P, NULL, "Cannot collect active power consumption data.") \
+	X(S, 0x08, 0x16, 0x08, 3, 4, 100.0, OB(S), 1 << G_S, NULL, "Cannot collect reactive power consumption data.") \
+	X(PR, 0x05, PP_RESET << 4, 0, 4, 4, 1000.0, OB(PR), 1 << G_W, NULL, "Cannot collect power counters data.") \
+	X(PRT1, 0x05, PP_RESET << 4, 1, 4, 4, 1000.0, OB(PRT[0]), 1 << G_W, NULL, "Cannot collect power counters data.") \
+	X(PRT2, 0x05, PP_RESET << 4, 2, 4, 4, 1000.0, OB(PRT[1]), 1 << G_W, NULL, "Cannot collect power counters data.") \
+	X(PY, 0x05, PP_YESTERDAY << 4, 0, 4, 4, 1000.0, OB(PY), 1 << G_W, NULL, "Cannot collect power counters data.") \
+	X(PT, 0x05, PP_TODAY << 4, 0, 4, 4, 1000.0, OB(PT), 1 << G_W, NULL, "Cannot collect power counters data.") \
+	X(CLOSE, 0x02, 0x00, 0x00, 0, 0, 1.0, 0, 0, NULL, "Power meter connection closing error.")
+
+#define STEP_ENUM(step, ...)	STEP_##step,
+typedef enum
+{
+	POLL_STEPS(STEP_ENUM)
+	STEP_NUM
+} PollStep;
+
+// Output fields validity bits: one per data step from STEP_U to STEP_PT
+#define FIELD_BIT(step)	(1 << ((step) - STEP_U))
+#define FIELDS_ALL	(FIELD_BIT(STEP_CLOSE) - 1)
+
+typedef enum			// Port events the context waits for / has got (bit mask)
+{
+	MERCURY_IDLE = 0,	// the poll is over
+	MERCURY_READ = 1,
+	MERCURY_WRITE = 2
+} MercuryInterest;
+
+typedef enum
+{
+	MS_IDLE = 0,
+	MS_SEND,		// writing the request
+	MS_WAIT,		// waiting for the responce
+	MS_BACKOFF		// waiting to retry the transaction
+} MercuryState;
+
+// Port events and the time the context waits for
+typedef struct
+{
+	int		interest;	// MercuryInterest
+	double		deadline;	// CLOCK_MONOTONIC ms, 0 if none
+} MercuryWait;
+
+// Non-blocking poll context of the meter
+typedef struct
+{
+	int		fd;		// RS485 port
+	int		baud;		// port baud rate (the frame end gap)
+	int		keepSession;	// keep the session open between the polls
+	Meter		meter;		// results, session state, statistics
+	int		state;		// MercuryState
+	int		step;		// poll step transaction in progress
+	int		retry;		// retries of the transaction made
+	int		reconnected;	// session reopened within the poll
+	int		written;	// request bytes written
+	double		deadline;
+	unsigned char	buf[BSZ];
+	Frame		resp;		// responce being received
+} MercuryCtx;
+
+#pragma pack(pop)
+
+// Protocol options shared by all the contexts
+extern int txRetries;		// retries of the garbled or lost transaction
+extern int breakerTimeouts;	// consecutive timeouts cutting the meter off, 0 - never
+
+// -- Parse the responce timeouts (ms): comma-separated list of N for all the steps or STEP=N
+// -- Returns 0 if the list is invalid.
+int parseTimeouts(const char* list);
+
+// -- Monotonic clock (ms)
+double nowMs();
+
+// -- Set up the poll context of the meter on the port given
+void mercury_init(MercuryCtx* ctx, int fd, unsigned char address, int baud);
+
+// -- Start the poll of the meter: the session is opened if needed and the values due are read
+// -- Returns 0 if the meter is cut off by the breaker and its probe isn't due yet.
+int mercury_start(MercuryCtx* ctx);
+
+// -- Drive the poll with the port events ready (MercuryInterest bit mask) at the time given (CLOCK_MONOTONIC ms)
+// -- Returns the port events and the time to wait for, MERCURY_IDLE interest when the poll is over.
+MercuryWait mercury_step(MercuryCtx* ctx, int events, double now);
+
+#endif
@@ -0,0 +1,627 @@
+/*
+ *	Mercury 236 power meter emulator.
+ *
+ *	Creates a pseudo-terminal and answers the commands of mercury236 utility on it as the meters on RS485 bus do,
+ *	so the transaction code could be tested and benchmarked without the hardware.
+ *	Reply latency, byte pacing, jitter, CRC corruption and dropped replies are configurable.
+ *	The load profile has the 30 minutes records up to the current time.
+ */
+#define _XOPEN_SOURCE	600		// posix_openpt() and friends
+#include <sys/types.h>
+#include <sys/select.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "crc.h"
+
+#define UInt16		uint16_t
+#define byte		unsigned char
+#define BSZ		255
+#define MAX_METERS	32		// Max number of meters emulated on the bus
+#define DEF_ADDRESS	1		// Default RS485 address of the meter emulated
+#define DEF_LATENCY	5000		// Default reply latency (mks)
+#define OPT_DEBUG	"--debug"
+#define OPT_HELP	"--help"
+#define OPT_ADDRESS	"--address"
+#define OPT_LINK	"--link"
+#define OPT_LATENCY	"--latency"
+#define OPT_JITTER	"--jitter"
+#define OPT_PACING	"--pacing"
+#define OPT_CORRUPT	"--corrupt"
+#define OPT_DROP	"--drop"
+#define OPT_NO_AUX	"--noAux"
+#define OPT_AUX_SHORT	"--auxShort"
+#define OPT_SEED	"--seed"
+#define OPT_BAUD	"--baud"
+#define OPT_MAX_READ	"--maxRead"
+#define PROFILE_MEMORY	0x03		// Memory number of the load profile
+#define PROFILE_RECORD	16		// Load profile record size
+#define PROFILE_RECORDS	4096		// Load profile memory size in records
+#define PROFILE_PERIOD	30		// Load profile integration period (min)
+
+typedef enum
+{
+	OK = 0,
+	ILLEGAL_CMD = 1,
+	CHANNEL_ISNT_OPEN = 5
+} ResultCode;
+
+// Meter emulated on the bus
+typedef struct
+{
+	byte		address;
+	int		online;		// session is open
+	double		energy;		// active energy counter from reset (kWh)
+} Meter;
+
+int debugPrint = 0;
+volatile sig_atomic_t stopRequested = 0;
+
+int meterNum = 0;
+Meter meters[MAX_METERS];
+long latency = DEF_LATENCY;		// reply latency (mks)
+long jitter = 0;			// random extra reply latency up to (mks)
+long pacing = 0;			// gap between the reply bytes (mks)
+int corruptRate = 0;			// replies with the wrong CRC (%)
+int dropRate = 0;			// requests not answered (%)
+int noAux = 0;				// the auxiliary parameters array read is rejected
+int auxShort = 0;			// the auxiliary parameters array is answered without the angles
+speed_t lineSpeed = 0;			// the requests sent at other port speeds are garbled, 0 - any speed
+int slave = -1;				// pseudo-terminal end the utility opens
+int maxRead = BSZ;			// the larger memory reads are rejected (bytes)
+
+// Statistics
+long requests = 0, replies = 0, dropped = 0, corrupted = 0, badRequests = 0;
+
+// -- Abnormal termination
+void exitFailure(const char* msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+// -- Print the frame in debug mode
+void printPackage(byte *data, int size, int isin)
+{
+	if (debugPrint)
+	{
+		printf("%s bytes: %d\n\r\t", (isin) ? "Received" : "Sent", size);
+		for (int i=0; i<size; i++)
+			printf("%02X ", (byte)data[i]);
+		printf("\n\r");
+		fflush(stdout);
+	}
+}
+
+// -- Random event with the probability given (%)
+int chance(int percent)
+{
+	return percent > 0 && rand() % 100 < percent;
+}
+
+// -- Encode the value scaled by factor into 3 bytes (B3F layout)
+byte* F3B(byte* b, double v, double factor)
+{
+	int val = (int)(v * factor + 0.5);
+	b[0] = (val >> 16) & 0x3F;
+	b[1] = val & 0xFF;
+	b[2] = (val >> 8) & 0xFF;
+	return b + 3;
+}
+
+// -- Encode the value scaled by factor into 4 bytes (B4F layout)
+byte* F4B(byte* b, double v, double factor)
+{
+	unsigned val = (unsigned)(v * factor + 0.5);
+	b[0] = (val >> 16) & 0xFF;
+	b[1] = (val >> 24) & 0x3F;
+	b[2] = val & 0xFF;
+	b[3] = (val >> 8) & 0xFF;
+	return b + 4;
+}
+
+// -- Instantaneous values vector by BWRI: sum (if any) and phases
+// -- Returns number of values.
+int instantValues(byte BWRI, double* v)
+{
+	// The load drifts a little so the samples differ
+	double t = time(NULL) % 600 / 600.0;
+	double U[3] = { 229.8 + t, 231.2 - t, 230.5 };
+	double I[3] = { 4.215 + t, 1.870, 0.562 };
+	double C[3] = { 0.981, 0.875, 0.742 };
+	int n = 0;
+
+	switch(BWRI)
+	{
+		case 0x11:	// voltage
+			for (int p = 0; p < 3; p++)
+				v[n++] = U[p];
+			return n;
+
+		case 0x21:	// current
+			for (int p = 0; p < 3; p++)
+				v[n++] = I[p];
+			return n;
+
+		case 0x30:	// cos(f)
+			v[n++] = 0.912;
+			for (int p = 0; p < 3; p++)
+				v[n++] = C[p];
+			return n;
+
+		case 0x40:	// grid frequency
+			v[n++] = 50.01;
+			return n;
+
+		case 0x51:	// phase angles
+			v[n++] = 0.0;
+			v[n++] = 120.03;
+			v[n++] = 239.97;
+			return n;
+
+		case 0x00:	// active power
+		case 0x08:	// reactive power
+			v[n++] = 0;
+			for (int p = 0; p < 3; p++)
+			{
+				double c = (0x00 == BWRI) ? C[p] : 1 - C[p];
+				v[n] = U[p] * I[p] * c;
+				v[0] += v[n++];
+			}
+			return n;
+
+		default:
+			return 0;
+	}
+}
+
+// -- Encode BCD byte
+byte BCD(int v)
+{
+	return (v / 10) << 4 | (v % 10);
+}
+
+// -- Build the load profile record of the memory slot given, the last record is written at the time given
+void profileRecord(int slot, time_t now, byte* rec)
+{
+	long last = now / (PROFILE_PERIOD * 60);
+	long period = last - (last - slot) % PROFILE_RECORDS;
+	time_t t = period * PROFILE_PERIOD * 60;
+	struct tm* tm = localtime(&t);
+
+	// Daily load curve (W): low at night, peaks in the morning and in the evening
+	static const int load[24] = { 500, 450, 400, 400, 450, 600, 1200, 1800, 1400, 1000, 900, 900,
+		1100, 1000, 900, 900, 1100, 1600, 2300, 2500, 2200, 1700, 1100, 700 };
+	int pulses = (load[tm->tm_hour] + period % 7 * 10) * 2 * 5000 / 1000 * PROFILE_PERIOD / 60;
+
+	bzero(rec, PROFILE_RECORD);
+	rec[1] = BCD(tm->tm_hour);
+	rec[2] = BCD(tm->tm_min);
+	rec[3] = BCD(tm->tm_mday);
+	rec[4] = BCD(tm->tm_mon + 1);
+	rec[5] = BCD(tm->tm_year % 100);
+	rec[6] = PROFILE_PERIOD;
+	rec[8] = pulses & 0xFF;
+	rec[9] = pulses >> 8;
+	rec[12] = (pulses / 5) & 0xFF;
+	rec[13] = (pulses / 5) >> 8;
+	// No export energy
+	rec[10] = rec[11] = rec[14] = rec[15] = 0xFF;
+}
+
+// -- Build the reply data (no address and CRC) to the request
+// -- Returns the data size.
+int replyData(Meter* meter, byte* req, byte* data)
+{
+	byte* d = data;
+	double v[4];
+
+	switch(req[1])
+	{
+		case 0x00:	// test connection
+			*d++ = OK;
+			break;
+
+		case 0x01:	// open session
+			meter->online = 1;
+			*d++ = OK;
+			break;
+
+		case 0x02:	// close session
+			meter->online = 0;
+			*d++ = OK;
+			break;
+
+		case 0x05:	// power counters: periodId << 4 | month, tariff
+			if (!meter->online)
+				*d++ = CHANNEL_ISNT_OPEN;
+			else
+			{
+				// Share of the energy by periods and tariffs
+				double share = ((req[2] >> 4) == 0) ? 1.0 : ((req[2] >> 4) == 4) ? 0.004 : 0.009;
+				if (req[3])
+					share *= (1 == req[3]) ? 0.7 : (2 == req[3]) ? 0.3 : 0;
+				d = F4B(d, meter->energy * share, 1000);
+				d = F4B(d, 0, 1000);
+				d = F4B(d, meter->energy * share * 0.12, 1000);
+				d = F4B(d, meter->energy * share * 0.01, 1000);
+			}
+			break;
+
+		case 0x08:	// auxiliary parameters
+			if (!meter->online)
+				*d++ = CHANNEL_ISNT_OPEN;
+			else if (0x16 == req[2] && instantValues(req[3], v))
+			{
+				int n = instantValues(req[3], v);
+				double factor = (0x21 == req[3] || 0x30 == req[3]) ? 1000 : 100;
+				for (int i = 0; i < n; i++)
+					d = F3B(d, v[i], factor);
+			}
+			else if (0x14 == req[2] && !noAux)
+			{
+				// All the instantaneous values: P, S, U, I, cos(f), F, angles
+				const byte layout[] = { 0x00, 0x08, 0x11, 0x21, 0x30, 0x40, 0x51 };
+				for (int b = 0; b < sizeof(layout) - auxShort; b++)
+				{
+					int n = instantValues(layout[b], v);
+					double factor = (0x21 == layout[b] || 0x30 == layout[b]) ? 1000 : 100;
+					for (int i = 0; i < n; i++)
+						d = F3B(d, v[i], factor);
+				}
+			}
+			else if (0x00 == req[2])
+			{
+				// Serial number 4 bytes by 2 digits (the last ones are the address), production date
+				const byte serial[] = { 12, 34, 56, meter->address % 100, 1, 1, 20 };
+				memcpy(d, serial, sizeof(serial));
+				d += sizeof(serial);
+			}
+			else if (0x13 == req[2])
+			{
+				// Last load profile record pointer
+				byte rec[PROFILE_RECORD];
+				int slot = time(NULL) / (PROFILE_PERIOD * 60) % PROFILE_RECORDS;
+				profileRecord(slot, time(NULL), rec);
+				*d++ = (slot * PROFILE_RECORD) >> 8;
+				*d++ = (slot * PROFILE_RECORD) & 0xFF;
+				memcpy(d, rec, 7);
+				d += 7;
+			}
+			else
+				*d++ = ILLEGAL_CMD;
+			break;
+
+		case 0x06:	// memory read: memory, address, count
+			if (!meter->online)
+				*d++ = CHANNEL_ISNT_OPEN;
+			else if (PROFILE_MEMORY == req[2] && req[5] && req[5] <= maxRead && req[5] <= BSZ - 3)
+			{
+				byte rec[PROFILE_RECORD];
+				int addr = req[3] << 8 | req[4];
+				for (int i = 0; i < req[5]; i++, addr++)
+				{
+					profileRecord(addr / PROFILE_RECORD % PROFILE_RECORDS, time(NULL), rec);
+					*d++ = rec[addr % PROFILE_RECORD];
+				}
+			}
+			else
+				*d++ = ILLEGAL_CMD;
+			break;
+
+		default:
+			*d++ = ILLEGAL_CMD;
+	}
+
+	return d - data;
+}
+
+// -- Request frame size by the command, 0 if unknown
+int requestSize(byte command)
+{
+	switch(command)
+	{
+		case 0x00:
+		case 0x02:
+			return 4;
+		case 0x01:
+			return 11;
+		case 0x05:
+		case 0x08:
+			return 6;
+		case 0x06:
+			return 8;
+		default:
+			return 0;
+	}
+}
+
+// -- Wait the reply latency with the jitter
+void replyDelay()
+{
+	long delay = latency + (jitter > 0 ? rand() % jitter : 0);
+	if (delay > 0)
+		usleep(delay);
+}
+
+// -- Send the reply frame paced byte by byte if required
+void sendReply(int fd, byte* frame, int len)
+{
+	printPackage(frame, len, 0);
+
+	if (!pacing)
+	{
+		write(fd, frame, len);
+		return;
+	}
+
+	for (int i = 0; i < len; i++)
+	{
+		write(fd, frame + i, 1);
+		usleep(pacing);
+	}
+}
+
+// -- Answer the request frame of the size expected
+void handleRequest(int fd, byte* req, int len)
+{
+	byte frame[BSZ];
+
+	printPackage(req, len, 1);
+	requests++;
+
+	// Meters ignore the damaged requests, the ones sent at the wrong speed too
+	struct termios tio;
+	tcgetattr(slave, &tio);
+	if (lineSpeed && cfgetospeed(&tio) != lineSpeed)
+	{
+		badRequests++;
+		return;
+	}
+
+	if (ModRTU_CRC(req, len - sizeof(UInt16)) != (req[len - 2] | (req[len - 1] << 8)))
+	{
+		badRequests++;
+		return;
+	}
+
+	// Any meter answers to the address 0
+	Meter* meter = NULL;
+	for (int m = 0; m < meterNum && !meter; m++)
+		if (0 == req[0] || meters[m].address == req[0])
+			meter = &meters[m];
+	if (!meter)
+		return;
+
+	if (chance(dropRate))
+	{
+		dropped++;
+		return;
+	}
+
+	frame[0] = meter->address;
+	int fl = 1 + replyData(meter, req, frame + 1);
+	UInt16 crc = ModRTU_CRC(frame, fl);
+	if (chance(corruptRate))
+	{
+		crc ^= 0x5A5A;
+		corrupted++;
+	}
+	frame[fl++] = crc & 0xFF;
+	frame[fl++] = crc >> 8;
+
+	replyDelay();
+	sendReply(fd, frame, fl);
+	replies++;
+}
+
+// -- Parse comma-separated list of meter addresses
+// -- Returns number of meters or 0 if the list is invalid.
+int parseAddresses(const char* list)
+{
+	int n = 0;
+	char* end;
+
+	do
+	{
+		long addr = strtol(list, &end, 10);
+		if (end == list || addr < 1 || addr > 0xFF || n == MAX_METERS)
+			return 0;
+
+		bzero(&meters[n], sizeof(Meter));
+		meters[n++].address = addr;
+		list = end + 1;
+	}
+	while (*end == ',');
+
+	return *end ? 0 : n;
+}
+
+// -- Termination request
+void onStopSignal(int sig)
+{
+	stopRequested = 1;
+}
+
+// -- Command line usage help
+void printUsage()
+{
+	printf("Usage: mercury236_emu [OPTIONS] ...\n\r\n\r");
+	printf("  Creates a pseudo-terminal with the emulated meters on it, its name is printed on start.\n\r\n\r");
+	printf("  %s N[,N...]\tRS485 addresses of the meters emulated (default %d)\n\r", OPT_ADDRESS, DEF_ADDRESS);
+	printf("  %s PATH\tsymbolic link to the pseudo-terminal to create\n\r", OPT_LINK);
+	printf("  %s N\treply latency in mks (default %d)\n\r", OPT_LATENCY, DEF_LATENCY);
+	printf("  %s N\trandom extra reply latency up to N mks\n\r", OPT_JITTER);
+	printf("  %s N\tgap between the reply bytes in mks (e.g. 1146 for 9600 baud)\n\r", OPT_PACING);
+	printf("  %s N\treplies with the wrong CRC, %%\n\r", OPT_CORRUPT);
+	printf("  %s N\trequests not answered, %%\n\r", OPT_DROP);
+	printf("  %s\tto reject the auxiliary parameters array read (older firmware)\n\r", OPT_NO_AUX);
+	printf("  %s\tto answer the auxiliary parameters array read without the phase angles (another layout)\n\r", OPT_AUX_SHORT);
+	printf("  %s N\tmeter baud rate: the requests sent at the other port speeds are ignored (default any)\n\r", OPT_BAUD);
+	printf("  %s N\tmax memory bytes read at once, the larger reads are rejected (default %d)\n\r", OPT_MAX_READ, BSZ);
+	printf("  %s N\trandom seed for the repeatable runs (default 1)\n\r", OPT_SEED);
+	printf("  %s\tto print the frames\n\r", OPT_DEBUG);
+	printf("  %s\tprints this screen\n\r", OPT_HELP);
+	printf("\n\r  The statistics are printed on SIGINT/SIGTERM.\n\r");
+}
+
+int main(int argc, const char** args)
+{
+	const char* link = NULL;
+	unsigned seed = 1;
+
+	for (int i=1; i<argc; i++)
+	{
+		if (!strcmp(OPT_DEBUG, args[i]))
+			debugPrint = 1;
+		else if (!strcmp(OPT_ADDRESS, args[i]) && i+1 < argc)
+		{
+			if (!(meterNum = parseAddresses(args[++i])))
+			{
+				printf("Error: invalid %s list %s\n\r\n\r", OPT_ADDRESS, args[i]);
+				printUsage();
+				exit(1);
+			}
+		}
+		else if (!strcmp(OPT_LINK, args[i]) && i+1 < argc)
+			link = args[++i];
+		else if (!strcmp(OPT_LATENCY, args[i]) && i+1 < argc)
+			latency = atol(args[++i]);
+		else if (!strcmp(OPT_JITTER, args[i]) && i+1 < argc)
+			jitter = atol(args[++i]);
+		else if (!strcmp(OPT_PACING, args[i]) && i+1 < argc)
+			pacing = atol(args[++i]);
+		else if (!strcmp(OPT_CORRUPT, args[i]) && i+1 < argc)
+			corruptRate = atoi(args[++i]);
+		else if (!strcmp(OPT_DROP, args[i]) && i+1 < argc)
+			dropRate = atoi(args[++i]);
+		else if (!strcmp(OPT_NO_AUX, args[i]))
+			noAux = 1;
+		else if (!strcmp(OPT_AUX_SHORT, args[i]))
+			auxShort = 1;
+		else if (!strcmp(OPT_BAUD, args[i]) && i+1 < argc)
+		{
+			const int bps[] = { 300, 600, 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200 };
+			const speed_t speeds[] = { B300, B600, B1200, B2400, B4800, B9600, B19200, B38400, B57600, B115200 };
+			int b = atoi(args[++i]);
+			for (int s = 0; s < sizeof(bps) / sizeof(bps[0]); s++)
+				if (bps[s] == b)
+					lineSpeed = speeds[s];
+			if (!lineSpeed)
+			{
+				printf("Error: invalid %s %s\n\r\n\r", OPT_BAUD, args[i]);
+				printUsage();
+				exit(1);
+			}
+		}
+		else if (!strcmp(OPT_MAX_READ, args[i]) && i+1 < argc)
+			maxRead = atoi(args[++i]);
+		else if (!strcmp(OPT_SEED, args[i]) && i+1 < argc)
+			seed = atoi(args[++i]);
+		else if (!strcmp(OPT_HELP, args[i]))
+		{
+			printUsage();
+			exit(0);
+		}
+		else
+		{
+			printf("Error: %s option is not recognised\n\r\n\r", args[i]);
+			printUsage();
+			exit(1);
+		}
+	}
+
+	if (!meterNum)
+	{
+		bzero(&meters[0], sizeof(Meter));
+		meters[0].address = DEF_ADDRESS;
+		meterNum = 1;
+	}
+	for (int m = 0; m < meterNum; m++)
+		meters[m].energy = 12345.678 + 1000 * m;
+	srand(seed);
+
+	// Pseudo-terminal: the slave end is kept open so the master doesn't get hangups between the clients
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) || unlockpt(fd))
+		exitFailure("Pseudo-terminal creation failed.");
+
+	const char* name = ptsname(fd);
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0)
+		exitFailure(name);
+
+	struct termios tio;
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	if (link)
+	{
+		unlink(link);
+		if (symlink(name, link))
+			exitFailure(link);
+	}
+
+	printf("%s\n\r", name);
+	fflush(stdout);
+
+	// The signals interrupt the read
+	struct sigaction sa;
+	bzero(&sa, sizeof(sa));
+	sa.sa_handler = onStopSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	byte buf[BSZ];
+	int len = 0;
+	while (!stopRequested)
+	{
+		int r = read(fd, buf + len, BSZ - len);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			exitFailure("Read failed.");
+		}
+		len += r;
+
+		// Complete requests are answered, unknown commands are dropped with the rest of the input
+		while (len >= 2)
+		{
+			int sz = requestSize(buf[1]);
+			if (!sz)
+			{
+				printPackage(buf, len, 1);
+				badRequests++;
+				len = 0;
+				break;
+			}
+			if (len < sz)
+				break;
+
+			handleRequest(fd, buf, sz);
+			len -= sz;
+			memmove(buf, buf + sz, len);
+		}
+	}
+
+	if (link)
+		unlink(link);
+	close(slave);
+	close(fd);
+
+	fprintf(stderr, "Requests: %ld, replies: %ld, dropped: %ld, corrupted: %ld, bad requests: %ld\n",
+		requests, replies, dropped, corrupted, badRequests);
+
+	return 0;
+}
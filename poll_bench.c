@@ -0,0 +1,300 @@
+/*
+ *	End-to-end poll cycle benchmark.
+ *
+ *	Runs full poll cycles (channel test, session open, data reads, session close) against the meter emulator
+ *	with several timing models and reports cycles per second and latency percentiles by poll step as JSON.
+ *	The api model runs the cycles with the non-blocking embedding API (mercury_step) driven by poll().
+ */
+#define MERCURY_LIBRARY
+#include "mercury236.c"
+
+#include <sys/wait.h>
+#include <poll.h>
+
+#define DEF_CYCLES	50		// Poll cycles per timing model
+#define MAX_CYCLES	10000
+#define EMU_START	2000		// Max time the emulator takes to create the pty (ms)
+#define OPT_CYCLES	"--cycles"
+#define OPT_OUT		"--out"
+#define OPT_EMU		"--emu"
+
+// Meter timing model: emulator options and the inter-command delay mode
+typedef struct
+{
+	const char*	name;
+	const char*	emuArgs[8];
+	int		fixedDelay;
+	int		api;		// the cycles are driven by mercury_step
+} TimingModel;
+
+static const TimingModel models[] =
+{
+	{ "instant", { "--latency", "0" } },
+	{ "usb", { "--latency", "5000" } },
+	{ "9600baud", { "--latency", "5000", "--pacing", "1146" } },
+	{ "jitter", { "--latency", "5000", "--pacing", "1146", "--jitter", "20000" } },
+	{ "fixedDelay", { "--latency", "5000", "--pacing", "1146" }, 1 },
+	// Older firmware: the auxiliary array is rejected, the values are read by the per-parameter steps
+	{ "noAux", { "--latency", "5000", "--pacing", "1146", "--noAux" } },
+	{ "api", { "--latency", "5000", "--pacing", "1146" }, 0, 1 }
+};
+
+#define MODEL_NUM	(int)(sizeof(models) / sizeof(models[0]))
+
+// Latency samples (ms)
+typedef struct
+{
+	int	count;
+	double	ms[MAX_CYCLES];
+} Samples;
+
+static Samples stepSamples[STEP_NUM];
+static Samples cycleSamples;
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// -- Record the latency sample (ms)
+void addSample(Samples* s, double ms)
+{
+	if (s->count < MAX_CYCLES)
+		s->ms[s->count++] = ms;
+}
+
+// -- Run the poll step transaction and record its latency
+int timedStep(int fd, Meter* meter, int step)
+{
+	double started = now();
+	int r = runStep(fd, meter, step);
+
+	addSample(&stepSamples[step], (now() - started) * 1000);
+
+	return r;
+}
+
+// -- Full poll cycle of the utility: the session is opened and closed every cycle (see pollMeter)
+// -- Returns 0 if any step has failed.
+int pollCycle(int fd, Meter* meter)
+{
+	int reconnected = 0;
+
+	startCycle(meter, time(NULL));
+	for (int step = STEP_CHECK; STEP_NUM != step; )
+	{
+		int r = timedStep(fd, meter, step);
+		if (OK != r && STEP_AUX != step)
+			return 0;
+		if ((step = pollNext(meter, step, r, 0, &reconnected)) < 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+// -- Full poll cycle driven by the embedding API, the port events are waited for with poll()
+// -- The step latency is the time from its request until the next step starts, the retries included.
+// -- Returns 0 if the poll has failed.
+int apiCycle(MercuryCtx* ctx)
+{
+	struct pollfd p = { ctx->fd };
+
+	if (!mercury_start(ctx))
+		return 0;
+
+	int step = ctx->step;
+	double started = nowMs();
+	MercuryWait w = mercury_step(ctx, 0, started);
+	while (w.interest)
+	{
+		int timeout = -1;
+		if (w.deadline)
+			timeout = (w.deadline > nowMs()) ? (int)(w.deadline - nowMs()) + 1 : 0;
+
+		p.events = ((w.interest & MERCURY_READ) ? POLLIN : 0) | ((w.interest & MERCURY_WRITE) ? POLLOUT : 0);
+		p.revents = 0;
+		poll(&p, 1, timeout);
+
+		double t = nowMs();
+		w = mercury_step(ctx, ((p.revents & (POLLIN | POLLERR | POLLHUP)) ? MERCURY_READ : 0) |
+			((p.revents & POLLOUT) ? MERCURY_WRITE : 0), t);
+		if (ctx->step != step || !w.interest)
+		{
+			addSample(&stepSamples[step], t - started);
+			step = ctx->step;
+			started = t;
+		}
+	}
+
+	return !ctx->meter.failure;
+}
+
+int compareMs(const void* a, const void* b)
+{
+	double d = *(const double*)a - *(const double*)b;
+	return (d > 0) - (d < 0);
+}
+
+// -- Print the percentiles of the samples as JSON object
+void printPercentiles(FILE* out, Samples* s)
+{
+	int p[] = { 50, 95, 99 };
+
+	qsort(s->ms, s->count, sizeof(double), compareMs);
+
+	fprintf(out, "{\"count\":%d", s->count);
+	for (int i = 0; i < 3; i++)
+	{
+		// Nearest rank
+		int rank = (p[i] * s->count + 99) / 100;
+		fprintf(out, ",\"p%d\":%.3f", p[i], s->count ? s->ms[rank - 1] : 0);
+	}
+	fprintf(out, "}");
+}
+
+// -- Start the emulator with the timing model on the pty link given
+pid_t startEmulator(const char* emu, const TimingModel* model, const char* link)
+{
+	const char* argv[16] = { emu, "--link", link };
+	int argc = 3;
+
+	for (int i = 0; model->emuArgs[i]; i++)
+		argv[argc++] = model->emuArgs[i];
+
+	// The child mustn't flush the results buffered
+	unlink(link);
+	fflush(NULL);
+	pid_t pid = fork();
+	if (0 == pid)
+	{
+		freopen("/dev/null", "w", stdout);
+		execv(emu, (char* const*)argv);
+		perror(emu);
+		_exit(1);
+	}
+
+	for (int i = 0; i < EMU_START / 10 && access(link, F_OK); i++)
+		usleep(10000);
+
+	return pid;
+}
+
+// -- Run the poll cycles with the timing model and print the results
+// -- Returns 0 if the cycles have failed.
+int runModel(FILE* out, const char* emu, const TimingModel* model, int cycles)
+{
+	char link[BSZ];
+	struct termios oldtio;
+	Meter meter;
+	static MercuryCtx ctx;
+	static int fd = -1;
+	static pid_t pid;
+	static double started, elapsed;
+	static int done;
+
+	snprintf(link, sizeof(link), "/tmp/mercury236_bench.%d", getpid());
+	bzero(stepSamples, sizeof(stepSamples));
+	bzero(&cycleSamples, sizeof(cycleSamples));
+	bzero(&meter, sizeof(meter));
+	fixedDelay = model->fixedDelay;
+	done = 0;
+
+	pid = startEmulator(emu, model, link);
+
+	// Protocol failures get back here
+	if (!setjmp(failureJump))
+	{
+		fd = openPort(link, &oldtio);
+		if (model->api)
+		{
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+			mercury_init(&ctx, fd, 0, BAUDRATE_BPS);
+		}
+
+		started = now();
+		for (done = 0; done < cycles; done++)
+		{
+			double cycleStarted = now();
+			if (!(model->api ? apiCycle(&ctx) : pollCycle(fd, &meter)))
+				break;
+			addSample(&cycleSamples, (now() - cycleStarted) * 1000);
+		}
+		elapsed = now() - started;
+	}
+
+	if (fd >= 0)
+		closePort(fd, &oldtio);
+	fd = -1;
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	unlink(link);
+
+	if (done < cycles)
+	{
+		fprintf(stderr, "%s: poll cycle %d has failed\n", model->name, done + 1);
+		fprintf(out, "{\"name\":\"%s\",\"failedCycle\":%d}", model->name, done + 1);
+		return 0;
+	}
+
+	fprintf(out, "{\"name\":\"%s\",\"cycles\":%d,\"cyclesPerSec\":%.3f,\"cycle\":", model->name, done, done / elapsed);
+	printPercentiles(out, &cycleSamples);
+	fprintf(out, ",\"steps\":{");
+	for (int step = 0, first = 1; step < STEP_NUM; step++)
+		if (stepSamples[step].count)
+		{
+			fprintf(out, "%s\"%s\":", first ? "" : ",", stepName[step]);
+			printPercentiles(out, &stepSamples[step]);
+			first = 0;
+		}
+	fprintf(out, "}}");
+
+	return 1;
+}
+
+int main(int argc, const char** args)
+{
+	int cycles = DEF_CYCLES;
+	const char* emu = "./mercury236_emu";
+	FILE* out = stdout;
+
+	for (int i=1; i<argc; i++)
+	{
+		if (!strcmp(OPT_CYCLES, args[i]) && i+1 < argc && atoi(args[i+1]) > 0 && atoi(args[i+1]) <= MAX_CYCLES)
+			cycles = atoi(args[++i]);
+		else if (!strcmp(OPT_EMU, args[i]) && i+1 < argc)
+			emu = args[++i];
+		else if (!strcmp(OPT_OUT, args[i]) && i+1 < argc)
+		{
+			if (!(out = fopen(args[++i], "w")))
+			{
+				perror(args[i]);
+				return 1;
+			}
+		}
+		else
+		{
+			printf("Usage: poll_bench [%s N (default %d)] [%s FILE (default stdout)] [%s EMULATOR (default %s)]\n",
+				OPT_CYCLES, DEF_CYCLES, OPT_OUT, OPT_EMU, emu);
+			return 1;
+		}
+	}
+
+	int ok = 1;
+	fprintf(out, "{\"cyclesPerModel\":%d,\"models\":[", cycles);
+	for (int m = 0; m < MODEL_NUM; m++)
+	{
+		fprintf(stderr, "%s...\n", models[m].name);
+		if (m)
+			fprintf(out, ",");
+		ok &= runModel(out, emu, &models[m], cycles);
+	}
+	fprintf(out, "]}\n");
+
+	if (out != stdout)
+		fclose(out);
+
+	return ok ? 0 : 1;
+}
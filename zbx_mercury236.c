@@ -0,0 +1,335 @@
+/*
+ *	Mercury 236 power meter Zabbix agent loadable module.
+ *
+ *	The background thread polls the meters once per interval with the same protocol code as the utility,
+ *	the items are answered from the last results kept in memory.
+ *	The agent forks its item processes after the module is loaded: the thread keeps running in the parent
+ *	process only, so the results are published to the shared memory mapping the item processes inherit.
+ *
+ *	Config file (ZBX_MERCURY236_CONF, MERCURY236_CONF environment variable overrides it):
+ *		Port=/dev/ttyUSB0	RS485 dongle, required
+ *		Address=0[,N...]	RS485 addresses of the meters (default 0 - any meter)
+ *		Interval=60		polling interval in seconds
+ *		Baud=9600|auto		port baud rate (default 9600), auto probes the rates supported
+ *
+ *	Items (ADDR is the meter address, the first one by default):
+ *		mercury236.voltage[p1|p2|p3,<ADDR>]
+ *		mercury236.current[p1|p2|p3,<ADDR>]
+ *		mercury236.cosf[sum|p1|p2|p3,<ADDR>]
+ *		mercury236.frequency[<ADDR>]
+ *		mercury236.angle[p1|p2|p3,<ADDR>]
+ *		mercury236.power[sum|p1|p2|p3,<ADDR>]			active power
+ *		mercury236.reactive[sum|p1|p2|p3,<ADDR>]		reactive power
+ *		mercury236.counter[reset|day|night|yesterday|today,<ap|am|rp|rm>,<ADDR>]
+ *		mercury236.age[<ADDR>]					seconds since the last poll
+ */
+#define MERCURY_LIBRARY
+#include "mercury236.c"
+
+// The protocol structures are packed, the agent ones are not
+#pragma pack()
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include "module.h"
+
+#ifndef ZBX_MERCURY236_CONF
+#define ZBX_MERCURY236_CONF	"/etc/zabbix/zbx_mercury236.conf"
+#endif
+
+#define ZBX_EXPORT		__attribute__((visibility("default")))
+
+// Module item: output block values selected by the key parameters
+typedef struct
+{
+	const char*		key;
+	size_t			field;		// output block field offset
+	const char* const*	names;		// values of the field selected by the 1st parameter, NULL if single value
+} ModuleItem;
+
+static const char* const p3v[] = { "p1", "p2", "p3", NULL };
+static const char* const p3vs[] = { "sum", "p1", "p2", "p3", NULL };
+static const char* const periods[] = { "reset", "day", "night", "yesterday", "today", NULL };	// PR, PRT[0], PRT[1], PY, PT
+static const char* const pwv[] = { "ap", "am", "rp", "rm", NULL };
+
+static const ModuleItem moduleItems[] =
+{
+	{ "mercury236.voltage", OB(U), p3v },
+	{ "mercury236.current", OB(I), p3v },
+	{ "mercury236.cosf", OB(C), p3vs },
+	{ "mercury236.frequency", OB(f), NULL },
+	{ "mercury236.angle", OB(A), p3v },
+	{ "mercury236.power", OB(P), p3vs },
+	{ "mercury236.reactive", OB(S), p3vs },
+	{ "mercury236.counter", OB(PR), periods },
+	{ "mercury236.age", 0, NULL },
+	{ NULL }
+};
+
+static int itemValue(AGENT_REQUEST* request, AGENT_RESULT* result);
+
+static ZBX_METRIC moduleMetrics[] =
+{
+	{ "mercury236.voltage", CF_HAVEPARAMS, itemValue, "p1" },
+	{ "mercury236.current", CF_HAVEPARAMS, itemValue, "p1" },
+	{ "mercury236.cosf", CF_HAVEPARAMS, itemValue, "sum" },
+	{ "mercury236.frequency", CF_HAVEPARAMS, itemValue, NULL },
+	{ "mercury236.angle", CF_HAVEPARAMS, itemValue, "p1" },
+	{ "mercury236.power", CF_HAVEPARAMS, itemValue, "sum" },
+	{ "mercury236.reactive", CF_HAVEPARAMS, itemValue, "sum" },
+	{ "mercury236.counter", CF_HAVEPARAMS, itemValue, "today" },
+	{ "mercury236.age", CF_HAVEPARAMS, itemValue, NULL },
+	{ NULL }
+};
+
+static char modulePort[BSZ];
+static int moduleInterval = DEF_INTERVAL;
+static int moduleMeterNum;
+static Meter moduleMeters[MAX_METERS];		// polled by the background thread
+
+// Last results answered to the items, shared by the agent processes
+typedef struct
+{
+	pthread_mutex_t	lock;			// process-shared
+	Meter		meters[MAX_METERS];
+} ModuleResults;
+
+static ModuleResults* moduleResults;
+static pthread_t moduleThread;
+static pid_t modulePid;				// process running the thread
+
+// -- Read the module config file
+// -- Returns 0 if the config is invalid.
+static int readConfig()
+{
+	char line[BSZ], value[BSZ];
+	const char* path = getenv("MERCURY236_CONF");
+
+	FILE* f = fopen(path ? path : ZBX_MERCURY236_CONF, "r");
+	if (!f)
+		return 0;
+
+	moduleMeterNum = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (1 == sscanf(line, " Port = %254s", value))
+			strcpy(modulePort, value);
+		else if (1 == sscanf(line, " Address = %254s", value))
+			moduleMeterNum = parseAddresses(value, moduleMeters);
+		else if (1 == sscanf(line, " Interval = %254s", value))
+			moduleInterval = atoi(value);
+		else if (1 == sscanf(line, " Baud = %254s", value))
+			baudRate = strcmp(value, "auto") ? atoi(value) : BAUD_AUTO;
+	}
+	fclose(f);
+
+	if (!moduleMeterNum)
+	{
+		bzero(&moduleMeters[0], sizeof(Meter));
+		moduleMeters[0].address = PM_ADDRESS;
+		moduleMeterNum = 1;
+	}
+
+	return modulePort[0] && moduleInterval > 0 && (BAUD_AUTO == baudRate || findBaud(baudRate));
+}
+
+// -- Make the poll results available to the items
+static void publishResults()
+{
+	pthread_mutex_lock(&moduleResults->lock);
+	memcpy(moduleResults->meters, moduleMeters, sizeof(moduleMeters));
+	pthread_mutex_unlock(&moduleResults->lock);
+}
+
+// -- Wait for the next poll, returns at once on the module unload
+static void waitInterval()
+{
+	for (int i = 0; i < moduleInterval && !stopRequested; i++)
+		sleep(1);
+}
+
+// -- Background poll loop, the sessions are kept open between the polls
+// -- The port is reopened after the failures.
+static void* pollMeters(void* arg)
+{
+	static int fd = -1;
+	static struct termios oldtio;
+
+	while (!stopRequested)
+	{
+		if (setjmp(failureJump))
+		{
+			if (fd >= 0)
+				closePort(fd, &oldtio);
+			fd = -1;
+			for (int m = 0; m < moduleMeterNum; m++)
+				moduleMeters[m].online = 0;
+			publishResults();
+			waitInterval();
+			continue;
+		}
+
+		if (fd < 0)
+		{
+			fd = openPort(modulePort, &oldtio);
+			portBaud = portSpeed(fd, modulePort, moduleMeters, moduleMeterNum);
+		}
+
+		for (int m = 0; m < moduleMeterNum && !stopRequested; m++)
+		{
+			Meter* meter = &moduleMeters[m];
+
+			// Meters not answering are probed again every poll until the breaker cuts them off
+			if (meter->online || probeDue(meter, time(NULL)))
+				pollMeter(fd, meter, 1);
+		}
+
+		publishResults();
+		waitInterval();
+	}
+
+	if (fd >= 0 && !setjmp(failureJump))
+	{
+		for (int m = 0; m < moduleMeterNum; m++)
+			if (moduleMeters[m].online)
+				closeConnection(fd, &moduleMeters[m]);
+		closePort(fd, &oldtio);
+	}
+
+	return NULL;
+}
+
+// -- Index of the key parameter value in the names list, -1 if not found
+static int paramIndex(const char* const* names, const char* param)
+{
+	for (int i = 0; param && names[i]; i++)
+		if (!strcmp(names[i], param))
+			return i;
+	return -1;
+}
+
+// -- Answer the item from the last poll results
+static int itemValue(AGENT_REQUEST* request, AGENT_RESULT* result)
+{
+	const ModuleItem* item = moduleItems;
+	while (item->key && strcmp(item->key, request->key))
+		item++;
+	if (!item->key)
+	{
+		SET_MSG_RESULT(result, strdup("Unsupported item key."));
+		return SYSINFO_RET_FAIL;
+	}
+
+	// Value selectors go first, the meter address is the last parameter (get_rparam is a macro)
+	int p = 0, i = 0, j = 0;
+	if (item->names)
+	{
+		if ((i = paramIndex(item->names, get_rparam(request, p))) < 0)
+		{
+			SET_MSG_RESULT(result, strdup("Invalid first parameter."));
+			return SYSINFO_RET_FAIL;
+		}
+		p++;
+	}
+	if (periods == item->names)
+	{
+		const char* dir = get_rparam(request, p);
+		if ((j = (dir && *dir) ? paramIndex(pwv, dir) : 0) < 0)
+		{
+			SET_MSG_RESULT(result, strdup("Invalid second parameter."));
+			return SYSINFO_RET_FAIL;
+		}
+		p++;
+	}
+	const char* addr = get_rparam(request, p);
+
+	Meter meter;
+	int m = 0;
+	pthread_mutex_lock(&moduleResults->lock);
+	while (m < moduleMeterNum && addr && *addr && moduleResults->meters[m].address != atoi(addr))
+		m++;
+	if (m < moduleMeterNum)
+		meter = moduleResults->meters[m];
+	pthread_mutex_unlock(&moduleResults->lock);
+
+	if (m == moduleMeterNum)
+	{
+		SET_MSG_RESULT(result, strdup("Unknown power meter."));
+		return SYSINFO_RET_FAIL;
+	}
+	if (!meter.online)
+	{
+		SET_MSG_RESULT(result, strdup(meter.cycleStarted ? "Power meter doesn't answer." : "No data collected yet."));
+		return SYSINFO_RET_FAIL;
+	}
+
+	// Data age item has no field
+	if (!item->field && !item->names)
+	{
+		SET_DBL_RESULT(result, time(NULL) - meter.cycleStarted);
+		return SYSINFO_RET_OK;
+	}
+
+	// Counters are power vectors by periods, the others are float vectors
+	size_t field = item->field + ((periods == item->names) ? i * 4 + j : i) * sizeof(float);
+	if (!fieldValid(&meter, field))
+	{
+		SET_MSG_RESULT(result, strdup("Power meter value read has failed."));
+		return SYSINFO_RET_FAIL;
+	}
+
+	SET_DBL_RESULT(result, *(float*)((byte*)&meter.o + field));
+	return SYSINFO_RET_OK;
+}
+
+ZBX_EXPORT int zbx_module_api_version(void)
+{
+	return ZBX_MODULE_API_VERSION;
+}
+
+ZBX_EXPORT int zbx_module_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	if (!readConfig())
+		return ZBX_MODULE_FAIL;
+
+	// Mapped before the agent forks its processes, so all of them see the results
+	moduleResults = mmap(NULL, sizeof(ModuleResults), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == moduleResults)
+		return ZBX_MODULE_FAIL;
+	bzero(moduleResults, sizeof(ModuleResults));
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&moduleResults->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	stopRequested = 0;
+	modulePid = getpid();
+	if (pthread_create(&moduleThread, NULL, pollMeters, NULL))
+		return ZBX_MODULE_FAIL;
+
+	return ZBX_MODULE_OK;
+}
+
+ZBX_EXPORT int zbx_module_uninit(void)
+{
+	// The forked processes have no thread to stop
+	if (getpid() != modulePid)
+		return ZBX_MODULE_OK;
+
+	stopRequested = 1;
+	pthread_join(moduleThread, NULL);
+	munmap(moduleResults, sizeof(ModuleResults));
+
+	return ZBX_MODULE_OK;
+}
+
+ZBX_EXPORT ZBX_METRIC* zbx_module_item_list(void)
+{
+	return moduleMetrics;
+}
+
+ZBX_EXPORT void zbx_module_item_timeout(int timeout)
+{
+}